@@ -1,5 +1,6 @@
 # Desktop application of DoubleContact
 
+DEFINES += WITH_NETWORK
 include(../core/core.pri)
 include(../model/model.pri)
 
@@ -38,10 +38,13 @@
 #include "settingsdialog.h"
 #include "sortdialog.h"
 #include "formats/iformat.h"
+#ifdef WITH_NETWORK
+#include "formats/network/imageloader.h"
+#endif
 
 MainWindow::MainWindow(QWidget *parent) :
     QMainWindow(parent),
-    ui(new Ui::MainWindow)
+    ui(new Ui::MainWindow), photoLoader(0), photoModel(0)
 {
     ui->setupUi(this);
     // Drag'n'drop support
@@ -888,6 +891,78 @@ void MainWindow::on_action_Drop_slashes_triggered()
     updateHeaders();
 }
 
+void MainWindow::on_action_Load_photos_triggered()
+{
+#ifdef WITH_NETWORK
+    if (photoLoader && photoLoader->isRunning()) {
+        QMessageBox::information(0, S_INFORM, tr("Photos are already loading"));
+        return;
+    }
+    ContactList& list = selectedModel->itemList();
+    if (list.photoURLCount==0) {
+        QMessageBox::information(0, S_INFORM, tr("There are no photos given by URL"));
+        return;
+    }
+    if (!photoLoader) {
+        photoLoader = new ImageLoader(this);
+        connect(photoLoader, SIGNAL(progress(int,int)), this, SLOT(photoProgress(int,int)));
+        connect(photoLoader, SIGNAL(finished(bool)), this, SLOT(photosLoaded(bool)));
+    }
+    // Table is updated as each photo arrives; list changes, that shift
+    // rows, stop loading
+    photoModel = selectedModel;
+    connect(photoLoader, SIGNAL(imageLoaded(int)), photoModel, SLOT(photoLoaded(int)));
+    connect(photoModel, SIGNAL(modelReset()), this, SLOT(cancelPhotoLoading()));
+    connect(photoModel, SIGNAL(rowsInserted(QModelIndex,int,int)), this, SLOT(cancelPhotoLoading()));
+    connect(photoModel, SIGNAL(rowsRemoved(QModelIndex,int,int)), this, SLOT(cancelPhotoLoading()));
+    photoLoader->loadImages(list);
+#else
+    QMessageBox::critical(0, S_ERROR, S_ERR_NETWORK_SUPPORT);
+#endif
+}
+
+void MainWindow::photoProgress(int done, int total)
+{
+    statusBar()->showMessage(tr("Loading photos: %1 of %2").arg(done).arg(total));
+}
+
+void MainWindow::photosLoaded(bool)
+{
+#ifdef WITH_NETWORK
+    ContactModel* model = photoModel;
+    releasePhotoModel();
+    statusBar()->clearMessage();
+    if (model)
+        showIOErrors(model->source(), photoLoader->loadedCount(), photoLoader->errors(), QString());
+    updateHeaders();
+#endif
+}
+
+void MainWindow::cancelPhotoLoading()
+{
+#ifdef WITH_NETWORK
+    if (!photoLoader || !photoLoader->isRunning())
+        return;
+    // Called inside list change, so no message box here
+    releasePhotoModel();
+    disconnect(photoLoader, SIGNAL(finished(bool)), this, SLOT(photosLoaded(bool)));
+    photoLoader->cancel();
+    connect(photoLoader, SIGNAL(finished(bool)), this, SLOT(photosLoaded(bool)));
+    statusBar()->showMessage(tr("Photo loading cancelled"));
+#endif
+}
+
+void MainWindow::releasePhotoModel()
+{
+#ifdef WITH_NETWORK
+    if (!photoModel)
+        return;
+    disconnect(photoLoader, SIGNAL(imageLoaded(int)), photoModel, SLOT(photoLoaded(int)));
+    disconnect(photoModel, 0, this, SLOT(cancelPhotoLoading()));
+    photoModel = 0;
+#endif
+}
+
 void MainWindow::on_action_Join_triggered()
 {
     if (!checkSelection()) return;
@@ -27,6 +27,8 @@ namespace Ui {
 class MainWindow;
 }
 
+class ImageLoader;
+
 class MainWindow : public QMainWindow
 {
     Q_OBJECT
@@ -80,6 +82,10 @@ private slots:
     void on_actionCompare_Result_triggered();
     void on_actionS_plit_names_triggered();
     void on_action_Drop_slashes_triggered();
+    void on_action_Load_photos_triggered();
+    void photoProgress(int done, int total);
+    void photosLoaded(bool);
+    void cancelPhotoLoading();
     void on_action_Generate_full_name_triggered();
     void on_action_Join_triggered();
     void on_actionDrop_full_name_triggered();
@@ -109,6 +115,11 @@ private:
     // End of potentially unsafe pointers
     QModelIndexList selection;
     QLabel *lbCount, *lbMode;
+    // Background photo loading; row indices are valid while rows of
+    // photoModel aren't inserted, removed or reset
+    ImageLoader* photoLoader;
+    ContactModel* photoModel;
+    void releasePhotoModel();
     void buildContextMenu(QTableView* view);
     void selectView(QTableView* view);
     bool checkSelection(bool errorIfNoSelected = true, bool onlyOneRowAllowed = false);
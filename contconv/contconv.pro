@@ -6,7 +6,7 @@
 
     QT       += core
     QT       -= gui
-    DEFINES -= WITH_NETWORK
+    DEFINES += WITH_NETWORK
     include(../core/core.pri)
 
     TARGET = contconv
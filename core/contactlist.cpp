@@ -198,6 +198,11 @@ void Messenger::StandardTypes::fill()
             << (*this)["pref"];
 }
 
+ContactItem::ContactItem()
+    :modified(false), pairState(PairNotFound), pairItem(0), pairIndex(-1)
+{
+}
+
 void ContactItem::clear()
 {
     id.clear();
@@ -231,6 +236,8 @@ void ContactItem::clear()
     nickName.clear();
     url.clear();
     ims.clear();
+    fileName.clear();
+    modified = false;
 }
 
 bool ContactItem::swapNames()
@@ -577,7 +584,161 @@ bool ContactItem::operator <(const ContactItem &pair) const
     return actualSortString < pair.actualSortString;
 }
 
+void ContactItem::swap(ContactItem &other)
+{
+    qSwap(fullName, other.fullName);
+    qSwap(names, other.names);
+    qSwap(phones, other.phones);
+    qSwap(emails, other.emails);
+    qSwap(birthday, other.birthday);
+    qSwap(anniversary, other.anniversary);
+    qSwap(sortString, other.sortString);
+    qSwap(description, other.description);
+    qSwap(photo.pType, other.photo.pType);
+    qSwap(photo.data, other.photo.data);
+    qSwap(photo.url, other.photo.url);
+    qSwap(groups, other.groups);
+    qSwap(organization, other.organization);
+    qSwap(title, other.title);
+    qSwap(addrs, other.addrs);
+    qSwap(nickName, other.nickName);
+    qSwap(url, other.url);
+    qSwap(ims, other.ims);
+    qSwap(id, other.id);
+    qSwap(idType, other.idType);
+    qSwap(originalFormat, other.originalFormat);
+    qSwap(version, other.version);
+    qSwap(subVersion, other.subVersion);
+    qSwap(fileName, other.fileName);
+    qSwap(modified, other.modified);
+    qSwap(otherTags, other.otherTags);
+    qSwap(unknownTags, other.unknownTags);
+    qSwap(visibleName, other.visibleName);
+    qSwap(prefPhone, other.prefPhone);
+    qSwap(prefEmail, other.prefEmail);
+    qSwap(prefIM, other.prefIM);
+    qSwap(allPhones, other.allPhones);
+    qSwap(homePhone, other.homePhone);
+    qSwap(workPhone, other.workPhone);
+    qSwap(cellPhone, other.cellPhone);
+    qSwap(pairState, other.pairState);
+    qSwap(pairItem, other.pairItem);
+    qSwap(pairIndex, other.pairIndex);
+    qSwap(actualSortString, other.actualSortString);
+}
+
+template<class T>
+static void writeStringItems(QDataStream& out, const QList<T>& items)
+{
+    out << (qint32)items.count();
+    foreach (const T& item, items)
+        out << item.types << (qint32)item.syncMLRef << item.value;
+}
+
+template<class T>
+static void readStringItems(QDataStream& in, QList<T>& items)
+{
+    qint32 count;
+    in >> count;
+    items.clear();
+    for (qint32 i=0; i<count && in.status()==QDataStream::Ok; i++) {
+        T item;
+        qint32 syncMLRef;
+        in >> item.types >> syncMLRef >> item.value;
+        item.syncMLRef = syncMLRef;
+        items << item;
+    }
+}
+
+static void writeDate(QDataStream& out, const DateItem& date)
+{
+    out << date.value << date.hasTime << date.hasTimeZone
+        << (qint16)date.zoneHour << (qint16)date.zoneMin;
+}
+
+static void readDate(QDataStream& in, DateItem& date)
+{
+    qint16 zoneHour, zoneMin;
+    in >> date.value >> date.hasTime >> date.hasTimeZone >> zoneHour >> zoneMin;
+    date.zoneHour = zoneHour;
+    date.zoneMin = zoneMin;
+}
+
+static void writeTags(QDataStream& out, const TagList& tags)
+{
+    out << (qint32)tags.count();
+    foreach (const TagValue& tag, tags)
+        out << tag.tag << tag.value;
+}
+
+static void readTags(QDataStream& in, TagList& tags)
+{
+    qint32 count;
+    in >> count;
+    tags.clear();
+    for (qint32 i=0; i<count && in.status()==QDataStream::Ok; i++) {
+        QString tag, value;
+        in >> tag >> value;
+        tags << TagValue(tag, value);
+    }
+}
+
+QDataStream& operator<<(QDataStream& out, const ContactItem& item)
+{
+    out << item.fullName << item.names;
+    writeStringItems(out, item.phones);
+    writeStringItems(out, item.emails);
+    writeDate(out, item.birthday);
+    writeDate(out, item.anniversary);
+    out << item.sortString << item.description
+        << item.photo.pType << item.photo.data << item.photo.url
+        << item.groups << item.organization << item.title;
+    out << (qint32)item.addrs.count();
+    foreach (const PostalAddress& addr, item.addrs)
+        out << addr.types << (qint32)addr.syncMLRef
+            << addr.offBox << addr.extended << addr.street << addr.city
+            << addr.region << addr.postalCode << addr.country;
+    out << item.nickName << item.url;
+    writeStringItems(out, item.ims);
+    out << item.id << item.idType << item.originalFormat << item.version << item.subVersion;
+    writeTags(out, item.otherTags);
+    writeTags(out, item.unknownTags);
+    return out;
+}
+
+QDataStream& operator>>(QDataStream& in, ContactItem& item)
+{
+    item.clear();
+    in >> item.fullName >> item.names;
+    readStringItems(in, item.phones);
+    readStringItems(in, item.emails);
+    readDate(in, item.birthday);
+    readDate(in, item.anniversary);
+    in >> item.sortString >> item.description
+       >> item.photo.pType >> item.photo.data >> item.photo.url
+       >> item.groups >> item.organization >> item.title;
+    qint32 addrCount;
+    in >> addrCount;
+    for (qint32 i=0; i<addrCount && in.status()==QDataStream::Ok; i++) {
+        PostalAddress addr;
+        qint32 syncMLRef;
+        in >> addr.types >> syncMLRef
+           >> addr.offBox >> addr.extended >> addr.street >> addr.city
+           >> addr.region >> addr.postalCode >> addr.country;
+        addr.syncMLRef = syncMLRef;
+        item.addrs << addr;
+    }
+    in >> item.nickName >> item.url;
+    readStringItems(in, item.ims);
+    in >> item.id >> item.idType >> item.originalFormat >> item.version >> item.subVersion;
+    readTags(in, item.otherTags);
+    readTags(in, item.unknownTags);
+    item.calculateFields();
+    return in;
+}
+
 ContactList::ContactList()
+    :photoURLCount(0)
 {
 }
 
@@ -588,6 +749,46 @@ void ContactList::clear()
     extra.clear();
     originalPath.clear();
     originalProfile.clear();
+    removedFiles.clear();
+    photoURLCount = 0;
+}
+
+void ContactList::appendSwapped(ContactItem &item)
+{
+    append(ContactItem());
+    last().swap(item);
+}
+
+void ContactList::insertItems(int pos, const QList<ContactItem> &newItems)
+{
+    if (pos>=count())
+        QList<ContactItem>::append(newItems);
+    else {
+        QList<ContactItem> res = mid(0, pos);
+        res += newItems;
+        res += mid(pos);
+        QList<ContactItem>::operator=(res);
+    }
+}
+
+void ContactList::removeItems(const QList<int> &sortedIndices)
+{
+    if (sortedIndices.isEmpty())
+        return;
+    QList<ContactItem> rest;
+    int nextRemoved = 0;
+    for (int i=0; i<count(); i++) {
+        // Skip duplicates in index list, if any
+        while (nextRemoved<sortedIndices.count() && sortedIndices[nextRemoved]<i)
+            nextRemoved++;
+        if (nextRemoved<sortedIndices.count() && sortedIndices[nextRemoved]==i) {
+            if (!at(i).fileName.isEmpty())
+                removedFiles << at(i).fileName;
+            continue;
+        }
+        rest << at(i);
+    }
+    QList<ContactItem>::operator=(rest);
 }
 
 void ContactList::sort(ContactList::SortType sortType)
@@ -708,6 +909,7 @@ bool ContactList::renameGroup(const QString &oldName, const QString &newName)
                 item.groups.removeOne(oldName);
                 item.groups << newName;
                 qSort(item.groups);
+                item.modified = true;
             }
         }
     }
@@ -718,7 +920,10 @@ bool ContactList::removeGroup(const QString &group)
 {
     bool changed = emptyGroups.removeOne(group);
     for (int i=0; i<this->count(); i++)
-        changed = changed || ((*this)[i].groups.removeOne(group));
+        if ((*this)[i].groups.removeOne(group)) {
+            (*this)[i].modified = true;
+            changed = true;
+        }
     return changed;
 }
 
@@ -736,6 +941,7 @@ void ContactList::includeToGroup(const QString &group, ContactItem &item)
     if (!item.groups.contains(group)) {
         item.groups << group;
         qSort(item.groups);
+        item.modified = true;
     }
     if (emptyGroups.contains(group))
         emptyGroups.removeOne(group);
@@ -743,7 +949,8 @@ void ContactList::includeToGroup(const QString &group, ContactItem &item)
 
 void ContactList::excludeFromGroup(const QString &group, ContactItem &item)
 {
-    item.groups.removeOne(group);
+    if (item.groups.removeOne(group))
+        item.modified = true;
     bool groupWillBeEmpty = true;
     foreach(const ContactItem &cand, *this)
         if (cand.groups.contains(group)) {
@@ -766,6 +973,7 @@ void ContactList::mergeGroups(const QString &unitedGroup, const QString &mergedG
                 item.groups << unitedGroup;
                 qSort(item.groups);
             }
+            item.modified = true;
         }
     }
     emptyGroups.removeOne(mergedGroup);
@@ -788,6 +996,7 @@ void ContactList::splitGroup(const QString &existGroup, const QString &newGroup,
                     item.groups << newGroup;
                     qSort(item.groups);
                 }
+                item.modified = true;
             }
         }
     }
@@ -1024,7 +1233,8 @@ bool Photo::isEmpty() const
 QString Photo::detectFormat() const
 {
     QString format = "UNKNOWN";
-    if (data.mid(6, 4).contains("JFIF"))
+    // JFIF and Exif JPEGs both start with SOI marker
+    if (data.mid(6, 4).contains("JFIF") || data.startsWith("\xFF\xD8\xFF"))
         format = "JPEG";
     else if (data.mid(1, 3).contains("PNG"))
         format = "PNG";
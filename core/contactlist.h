@@ -15,6 +15,7 @@
 #define CONTACTLIST_H
 
 #include <QByteArray>
+#include <QDataStream>
 #include <QDateTime>
 #include <QMap>
 #include <QStringList>
@@ -162,6 +163,8 @@ struct ContactItem {
     QString idType; // tag name    
     QString originalFormat;
     QString version, subVersion;
+    QString fileName; // own file in source storage: VCFDirectory file name or CardDAV resource path
+    bool modified; // edited after load or save, for incremental save
     TagList otherTags;   // Known but un-editing tags
     TagList unknownTags; // specific tags for any file format, i.e. vcf
     // Calculated fields for higher perfomance
@@ -177,6 +180,7 @@ struct ContactItem {
     int pairIndex;
     // Calculated fields for hard sorting
     QString actualSortString; // Can be sortString, name(s), nick, depends on settings
+    ContactItem();
     // Editing
     void clear();
     bool swapNames();
@@ -197,8 +201,26 @@ struct ContactItem {
     static QString nameComponent(int compNum);
     const QString findIMByType(const QString& itemType) const;
     bool operator <(const ContactItem& pair) const;
+    void swap(ContactItem& other); // member-wise, without data copying
 };
 
+// Sorting and container filling use swap instead of copying (no move semantics in C++98)
+inline void swap(ContactItem& value1, ContactItem& value2)
+{
+    value1.swap(value2);
+}
+#if QT_VERSION < 0x050000
+template<>
+inline void qSwap<ContactItem>(ContactItem& value1, ContactItem& value2)
+{
+    value1.swap(value2);
+}
+#endif
+
+// Binary form of editable contact data, for caches (calculated fields are recalculated on read)
+QDataStream& operator<<(QDataStream& out, const ContactItem& item);
+QDataStream& operator>>(QDataStream& in, ContactItem& item);
+
 // Specific data for backup files (MPB, NBF, NBU)
 struct CallInfo {
     QString cType, timeStamp, duration, number, name;
@@ -245,6 +267,9 @@ public:
         SortByGroup
     };
     void clear();
+    void appendSwapped(ContactItem& item); // item will be empty after call
+    void insertItems(int pos, const QList<ContactItem>& newItems); // in one pass
+    void removeItems(const QList<int>& sortedIndices); // in one pass
     void sort(SortType sortType);
     void compareWith(ContactList& pairList);
     // Group operations
@@ -265,6 +290,7 @@ public:
     QStringList emptyGroups;
     QString originalPath; // for append-only formats, such as NBF
     QString originalProfile; // for CSV; see also ContactItem::originalFormat
+    QStringList removedFiles; // own files of removed contacts (VCFDirectory, CardDAV)
     // Calculated
     int photoURLCount;
 };
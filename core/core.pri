@@ -28,6 +28,7 @@ HEADERS	+= \
     $$PWD/languagemanager.h \
     $$PWD/formats/iformat.h \
     $$PWD/formats/formatfactory.h \
+    $$PWD/formats/common/csvstream.h \
     $$PWD/formats/common/nokiadata.h \
     $$PWD/formats/common/pdu.h \
     $$PWD/formats/common/quotedprintable.h \
@@ -55,6 +56,7 @@ SOURCES	+= \
     $$PWD/globals.cpp \
     $$PWD/languagemanager.cpp \
     $$PWD/formats/formatfactory.cpp \
+    $$PWD/formats/common/csvstream.cpp \
     $$PWD/formats/common/nokiadata.cpp \
     $$PWD/formats/common/pdu.cpp \
     $$PWD/formats/common/quotedprintable.cpp \
@@ -0,0 +1,228 @@
+/* Double Contact
+ *
+ * Module: Streaming CSV reader/writer
+ *
+ * Copyright 2019 Mikhail Y. Zvyozdochkin aka DarkHobbit <pub@zvyozdochkin.ru>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version. See COPYING file for more details.
+ *
+ */
+
+#include <QByteArray>
+#include "csvstream.h"
+
+CSVReader::CSVReader(QIODevice *device, const QString &encoding)
+    :_device(device), decoder(0), pos(0), scanPos(0), scanInQuotes(false),
+      scanLines(0), line(1), rowLine(1)
+{
+    codec = QTextCodec::codecForName(encoding.toLatin1());
+    if (!codec)
+        codec = QTextCodec::codecForName("UTF-8");
+}
+
+CSVReader::CSVReader(const QString &text)
+    :_device(0), codec(0), decoder(0), buf(text), pos(0), scanPos(0), scanInQuotes(false),
+      scanLines(0), line(1), rowLine(1)
+{}
+
+CSVReader::~CSVReader()
+{
+    if (decoder)
+        delete decoder;
+}
+
+bool CSVReader::readRow(QStringList &row)
+{
+    row.clear();
+    forever {
+        // Search record end; newlines inside quotes are part of field.
+        // Doubled quote toggles state twice, so it needs no special care here
+        const QChar* d = buf.unicode();
+        int n = buf.length();
+        int i = scanPos;
+        bool inQuotes = scanInQuotes;
+        int lines = scanLines;
+        for (; i<n; i++) {
+            const ushort c = d[i].unicode();
+            if (c=='\n') {
+                if (!inQuotes)
+                    break;
+                lines++;
+            }
+            else if (c=='"')
+                inQuotes = !inQuotes;
+        }
+        bool found = (i<n);
+        if (!found) {
+            scanPos = i;
+            scanInQuotes = inQuotes;
+            scanLines = lines;
+            if (readBlock())
+                continue;
+        }
+        // Record is [pos, i)
+        d = buf.unicode();
+        int start = pos;
+        int end = i;
+        pos = found ? i+1 : n;
+        scanPos = pos;
+        scanInQuotes = false;
+        scanLines = 0;
+        rowLine = line;
+        line += lines + 1;
+        while (start<end && d[start].isSpace())
+            start++;
+        while (end>start && d[end-1].isSpace())
+            end--;
+        if (start==end) {
+            if (found)
+                continue; // empty line
+            else
+                return false;
+        }
+        splitRecord(start, end, row);
+        return true;
+    }
+}
+
+int CSVReader::lineNumber() const
+{
+    return rowLine;
+}
+
+bool CSVReader::readBlock()
+{
+    if (!_device)
+        return false;
+    QByteArray data = _device->read(CSV_BLOCK_SIZE);
+    if (data.isEmpty())
+        return false;
+    bool firstBlock = !decoder;
+    if (firstBlock) {
+        // BOM, if present, overrides profile charset
+        codec = QTextCodec::codecForUtfText(data, codec);
+        decoder = codec->makeDecoder();
+    }
+    // Drop parsed text, keep unfinished record
+    if (pos>0) {
+        buf.remove(0, pos);
+        scanPos -= pos;
+        pos = 0;
+    }
+    buf += decoder->toUnicode(data);
+    if (firstBlock && buf.startsWith(QChar(0xFEFF)))
+        buf.remove(0, 1);
+    return true;
+}
+
+void CSVReader::splitRecord(int start, int end, QStringList &row) const
+{
+    const QChar* d = buf.unicode();
+    int i = start;
+    forever {
+        QString val;
+        bool inQuotes = false;
+        bool plain = true; // field without quotes, take it at once
+        int segStart = i;
+        for (; i<end; i++) {
+            const ushort c = d[i].unicode();
+            if (c=='"') {
+                val += QString(d+segStart, i-segStart);
+                if (inQuotes && i+1<end && d[i+1].unicode()=='"') {
+                    val += QChar('"');
+                    i++;
+                }
+                else
+                    inQuotes = !inQuotes;
+                segStart = i+1;
+                plain = false;
+            }
+            else if ((c==',' || c==';') && !inQuotes)
+                break;
+        }
+        if (plain)
+            val = buf.mid(segStart, i-segStart);
+        else
+            val += QString(d+segStart, i-segStart);
+        row << val;
+        if (i>=end)
+            break;
+        i++; // separator
+    }
+}
+
+CSVWriter::CSVWriter(QIODevice *device, const QString &encoding, const QString &separator,
+    CSVProfileBase::QuotingPolicy quotingPolicy, CSVProfileBase::LineEnding lineEnding, bool hasBOM)
+    :_device(device),
+      state(hasBOM ? QTextCodec::DefaultConversion : QTextCodec::IgnoreHeader),
+      _separator(separator),
+      _lineEnding(lineEnding==CSVProfileBase::CRLFEnding ? "\r\n" : "\n"),
+      _quotingPolicy(quotingPolicy), writeError(false)
+{
+    codec = QTextCodec::codecForName(encoding.toLatin1());
+    if (!codec)
+        codec = QTextCodec::codecForName("UTF-8");
+    buf.reserve(CSV_BLOCK_SIZE*2);
+}
+
+void CSVWriter::writeRow(const QStringList &row)
+{
+    for (int i=0; i<row.count(); i++) {
+        if (i>0)
+            buf += _separator;
+        const QString& cell = row[i];
+        switch (_quotingPolicy) {
+        case CSVProfileBase::AlwaysQuote:
+            putQuoted(cell);
+            break;
+        case CSVProfileBase::NeverQuote:
+            buf += cell;
+            break;
+        case CSVProfileBase::QuoteIfNeed:
+            if (needQuotes(cell))
+                putQuoted(cell);
+            else
+                buf += cell;
+            break;
+        }
+    }
+    buf += _lineEnding;
+    if (buf.length()>=CSV_BLOCK_SIZE)
+        flush();
+}
+
+bool CSVWriter::flush()
+{
+    if (!buf.isEmpty()) {
+        QByteArray data = codec->fromUnicode(buf.unicode(), buf.length(), &state);
+        if (_device->write(data)!=data.length())
+            writeError = true;
+        buf.resize(0);
+    }
+    return !writeError;
+}
+
+bool CSVWriter::needQuotes(const QString &cell) const
+{
+    // CSVReader splits by both comma and semicolon
+    const QChar* d = cell.unicode();
+    for (int i=0; i<cell.length(); i++) {
+        const ushort c = d[i].unicode();
+        if (c==',' || c==';' || c=='"' || c=='\n' || c=='\r')
+            return true;
+    }
+    return cell.contains(_separator);
+}
+
+void CSVWriter::putQuoted(const QString &cell)
+{
+    buf += QChar('"');
+    if (cell.contains(QChar('"')))
+        buf += QString(cell).replace(QChar('"'), "\"\"");
+    else
+        buf += cell;
+    buf += QChar('"');
+}
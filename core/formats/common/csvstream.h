@@ -0,0 +1,71 @@
+/* Double Contact
+ *
+ * Module: Streaming CSV reader/writer
+ *
+ * Copyright 2019 Mikhail Y. Zvyozdochkin aka DarkHobbit <pub@zvyozdochkin.ru>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version. See COPYING file for more details.
+ *
+ */
+#ifndef CSVSTREAM_H
+#define CSVSTREAM_H
+
+#include <QIODevice>
+#include <QString>
+#include <QStringList>
+#include <QTextCodec>
+#include "../profiles/csvprofilebase.h"
+
+// Bytes per one file read/write
+#define CSV_BLOCK_SIZE 65536
+
+// RFC 4180 reader. Quoted fields may contain separators, doubled quotes
+// and line breaks. Both comma and semicolon are separators.
+// Reads from device block by block, or from ready text
+class CSVReader
+{
+public:
+    CSVReader(QIODevice* device, const QString& encoding);
+    CSVReader(const QString& text);
+    ~CSVReader();
+    bool readRow(QStringList& row); // false if no more rows
+    int lineNumber() const; // first line of last read row, 1-based
+private:
+    QIODevice* _device;
+    QTextCodec* codec;
+    QTextDecoder* decoder;
+    QString buf;
+    int pos;             // start of unparsed text in buf
+    int scanPos;         // record end search state,
+    bool scanInQuotes;   // kept if record is longer than block
+    int scanLines;
+    int line, rowLine;
+    bool readBlock();
+    void splitRecord(int start, int end, QStringList& row) const;
+};
+
+// Writer, converting rows into one reusable buffer
+// and flushing it to device by big blocks
+class CSVWriter
+{
+public:
+    CSVWriter(QIODevice* device, const QString& encoding, const QString& separator,
+        CSVProfileBase::QuotingPolicy quotingPolicy, CSVProfileBase::LineEnding lineEnding, bool hasBOM);
+    void writeRow(const QStringList& row);
+    bool flush(); // false if write error occured (including previous blocks)
+private:
+    QIODevice* _device;
+    QTextCodec* codec;
+    QTextCodec::ConverterState state;
+    QString _separator, _lineEnding;
+    CSVProfileBase::QuotingPolicy _quotingPolicy;
+    QString buf;
+    bool writeError;
+    bool needQuotes(const QString& cell) const;
+    void putQuoted(const QString& cell);
+};
+
+#endif // CSVSTREAM_H
@@ -58,7 +58,7 @@ bool PDU::parseMessage(QDataStream& ds, DecodedMessage& msg, int offset, int &Ms
     default:
         return false;
     }
-    msg.contacts << c;
+    msg.contacts.appendSwapped(c);
     return true;
 }
 
@@ -53,6 +53,12 @@ void VCardData::setSkipCoding(bool _skipEncoding, bool _skipDecoding)
     skipDecoding = _skipDecoding;
 }
 
+QString VCardData::importSettings()
+{
+    return QString("%1;%2")
+        .arg(gd.defaultEmptyPhoneType).arg(gd.warnOnNonStandardTypes ? 1 : 0);
+}
+
 bool VCardData::importRecords(QStringList &lines, ContactList& list, bool append, QStringList& errors)
 {
     bool recordOpened = false;
@@ -84,7 +90,7 @@ bool VCardData::importRecords(QStringList &lines, ContactList& list, bool append
         else if (s.startsWith("END:VCARD", Qt::CaseInsensitive)) {
             recordOpened = false;
             item.calculateFields();
-            list.push_back(item);
+            list.appendSwapped(item);
         }
         else {
             // Split type:value
@@ -309,7 +315,7 @@ bool VCardData::importRecords(QStringList &lines, ContactList& list, bool append
     }
     if (recordOpened) {
         item.calculateFields();
-        list.push_back(item);
+        list.appendSwapped(item);
         errors << QObject::tr("Last section not closed");
     }
     // Unknown tags statistics
@@ -28,6 +28,8 @@ public:
     bool importRecords(QStringList& lines, ContactList& list, bool append, QStringList& errors);
     bool exportRecords(QStringList& lines, const ContactList& list, QStringList& errors);
     void exportRecord(QStringList& lines, const ContactItem& item, QStringList& errors);
+    // Settings that change import result, for caches of parsed vCards
+    static QString importSettings();
 protected:
     bool useOriginalFileVersion, skipEncoding, skipDecoding;
 private:
@@ -11,9 +11,13 @@
  *
  */
 #include <QStringList>
-
 #include <QTextCodec>
+#include <QTextStream>
+#include <QThread>
+#include <QThreadPool>
+
 #include "csvfile.h"
+#include "../common/csvstream.h"
 #include "../profiles/explaybm50profile.h"
 #include "../profiles/explaytv240profile.h"
 #include "../profiles/genericcsvprofile.h"
@@ -37,13 +41,13 @@ CSVFile::~CSVFile()
 
 bool CSVFile::detect(const QString &url)
 {
-    QFile f(url);
-    if (!f.open(QIODevice::ReadOnly)) return false;
-    QTextStream stream(&f);
-    QString s1 = stream.readLine();
-    bool res = s1.contains(","); // TODO bad method. M.b. make CSVProfile::detect and call for all profiles
-    f.close();
-    return res;
+    return detectScore(FileHeader(url))!=NotDetected;
+}
+
+int CSVFile::detectScore(const FileHeader &header)
+{
+    // TODO bad method. M.b. make CSVProfile::detect and call for all profiles
+    return header.firstLine.contains(",") ? WeakDetected : NotDetected;
 }
 
 QStringList CSVFile::supportedExtensions()
@@ -100,112 +104,103 @@ bool CSVFile::importRecords(const QString &url, ContactList &list, bool append)
     if (!openFile(url, QIODevice::ReadOnly))
         return false;
     _errors.clear();
-    QList<QStringList> rows;
-    QTextStream stream(&file);
     if (_encoding.isEmpty())
         _encoding = currentProfile->charSet();
-    stream.setCodec(_encoding.toLatin1().data());
-    do {
-        QString line = stream.readLine();
-        bool inQuotes = false;
-        QString val = "";
-        QStringList row;
-        foreach(const QChar& c, line.trimmed()) {
-            switch (c.toLatin1()) {
-            case '\"':
-                inQuotes = !inQuotes;
-                break;
-            case ';':
-            case ',':
-                if (!inQuotes) {
-                    row << val;
-                    val.clear();
+    // Rows go to profile as soon as read, without collecting whole file
+    CSVReader reader(&file, _encoding);
+    QStringList row;
+    if (currentProfile->hasHeader() && reader.readRow(row))
+        currentProfile->parseHeader(row);
+    if (!append)
+        list.clear();
+    list.originalProfile = currentProfile->name();
+    // Debug log of vCard-based profile is one file for all threads
+    if (QThread::idealThreadCount()<2 || gd.debugSave) {
+        while (reader.readRow(row))
+            importRow(currentProfile, row, list, _errors);
+    }
+    else {
+        // Records after header are independent, so rows are splitted
+        // to batches, converted in parallel and merged in file order
+        QThreadPool pool;
+        const int maxTasks = pool.maxThreadCount()*2;
+        QList<CSVImportTask*> tasks;
+        bool moreRows = true;
+        while (moreRows) {
+            while (moreRows && tasks.count()<maxTasks) {
+                CSVImportTask* task = new CSVImportTask(currentProfile);
+                while (task->rows.count()<CSV_IMPORT_BATCH_SIZE && (moreRows = reader.readRow(row)))
+                    task->rows << row;
+                if (task->rows.isEmpty()) {
+                    delete task;
                     break;
-                } // fall through
-            case 0:
-            default:
-                val += c;
-                break;
+                }
+                tasks << task;
+                pool.start(task);
             }
+            pool.waitForDone();
+            foreach (CSVImportTask* task, tasks) {
+                for (int i=0; i<task->items.count(); i++)
+                    list.appendSwapped(task->items[i]);
+                _errors << task->errors;
+                delete task;
+            }
+            tasks.clear();
         }
-        row << val;
-        rows << row;
-    } while (!stream.atEnd());
-    closeFile();
-    int firstLine = currentProfile->hasHeader() ? 1 : 0;
-    if (currentProfile->hasHeader())
-        currentProfile->parseHeader(rows[0]);
-    if (!append)
-        list.clear();
-    for (int i=firstLine; i<rows.count(); i++) {
-        ContactItem item;
-        item.originalFormat = "CSV";
-        list.originalProfile = currentProfile->name();
-        currentProfile->importRecord(rows[i], item, _errors);
-        item.calculateFields();
-        list << item;
     }
-    // For new profiles debug
-    /* std::cout << url.toLocal8Bit().data() << std::endl;
-     std::cout << rows[0].count() << " " << rows[1].count()
-              << "|" << rows[0].last().toLocal8Bit().data() << std::endl; */
+    closeFile();
     // Ready
     return (!list.isEmpty());
 }
 
+void CSVFile::importRow(const CSVProfileBase *profile, const QStringList &row, ContactList &list, QStringList &errors)
+{
+    ContactItem item;
+    item.originalFormat = "CSV";
+    profile->importRecord(row, item, errors);
+    item.calculateFields();
+    list.appendSwapped(item);
+}
+
+CSVImportTask::CSVImportTask(const CSVProfileBase *profile)
+    :QRunnable(), _profile(profile)
+{
+    setAutoDelete(false);
+}
+
+void CSVImportTask::run()
+{
+    foreach (const QStringList& row, rows)
+        CSVFile::importRow(_profile, row, items, errors);
+    rows.clear();
+}
+
 bool CSVFile::exportRecords(const QString &url, ContactList &list)
 {
     if (!currentProfile)
         return false;
     if (!currentProfile->prepareExport(list))
         return false;
-    QList<QStringList> rows;
-    foreach (const ContactItem& item, list) {
-        QStringList row;
-        currentProfile->exportRecord(row, item, _errors);
-        rows << row;
-    }
     if (!openFile(url, QIODevice::WriteOnly))
         return false;
-    QTextStream stream(&file);
     if (_encoding.isEmpty())
         _encoding = currentProfile->charSet();
-    stream.setCodec(_encoding.toLatin1().data());
-    stream.setGenerateByteOrderMark(currentProfile->hasBOM());
+    // Each row written just after conversion, without list of all rows
+    CSVWriter writer(&file, _encoding, _separator,
+        currentProfile->quotingPolicy(), currentProfile->lineEnding(), currentProfile->hasBOM());
     // Header
     if (currentProfile->hasHeader())
-        putLine(stream, currentProfile->makeHeader());
+        writer.writeRow(currentProfile->makeHeader());
     // Items
-    foreach (const QStringList& row, rows)
-        putLine(stream, row);
-    closeFile();
-    return true;
-}
-void CSVFile::putLine(QTextStream& stream, const QStringList &source)
-{
-    // Quoting
-    switch (currentProfile->quotingPolicy()) {
-    case CSVProfileBase::AlwaysQuote:
-        stream << QString("\"%1\"").arg(source.join("\"%1\"").arg(_separator));
-        break;
-    case CSVProfileBase::NeverQuote:
-        stream << source.join(_separator);
-        break;
-    case CSVProfileBase::QuoteIfNeed:
-        QString line;
-        foreach (const QString& cell, source) {
-            if (cell.contains(_separator))
-                line += QString("\"%1\"").arg(cell);
-            else
-                line += cell;
-            line += _separator;
-        }
-        if (line.right(1)==_separator)
-            line.remove(line.length()-_separator.length(), _separator.length());
-        stream << line;
+    QStringList row;
+    foreach (const ContactItem& item, list) {
+        row.clear();
+        currentProfile->exportRecord(row, item, _errors);
+        writer.writeRow(row);
     }
-    // Line ending
-    if (currentProfile->lineEnding()==CSVProfileBase::CRLFEnding)
-        stream << (char)13;
-    stream << endl;
+    bool res = writer.flush();
+    if (!res)
+        _fatalError = S_WRITE_ERR.arg(url);
+    closeFile();
+    return res;
 }
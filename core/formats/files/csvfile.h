@@ -14,6 +14,7 @@
 #ifndef CSVFILE_H
 #define CSVFILE_H
 
+#include <QRunnable>
 #include <QStringList>
 #include <QTextStream>
 #include <QVector>
@@ -28,6 +29,7 @@ public:
     // IFormat interface
 public:
     static bool detect(const QString &url);
+    static int detectScore(const FileHeader& header);
     static QStringList supportedExtensions();
     static QStringList supportedFilters();
     QStringList availableProfiles();
@@ -37,11 +39,28 @@ public:
     QString profile();
     bool importRecords(const QString &url, ContactList &list, bool append);
     bool exportRecords(const QString &url, ContactList &list);
+    static void importRow(const CSVProfileBase* profile, const QStringList& row,
+        ContactList& list, QStringList& errors);
 private:
     QVector<CSVProfileBase*> profiles;
     CSVProfileBase* currentProfile;
     QString _encoding, _separator;
-    void putLine(QTextStream& stream, const QStringList& source);
+};
+
+// Rows per one parallel import task
+#define CSV_IMPORT_BATCH_SIZE 2048
+
+// Batch of CSV rows, converted to contacts in worker thread
+class CSVImportTask : public QRunnable
+{
+public:
+    CSVImportTask(const CSVProfileBase* profile);
+    void run();
+    QList<QStringList> rows;
+    ContactList items;
+    QStringList errors;
+private:
+    const CSVProfileBase* _profile;
 };
 
 #endif // CSVFILE_H
@@ -12,10 +12,34 @@
  */
 
 #include <QObject>
+#include <QTextCodec>
 
 #include "fileformat.h"
 #include "globals.h"
 
+FileHeader::FileHeader(const QString &path)
+    :path(path), isRead(false)
+{
+    QFile f(path);
+    if (!f.open(QIODevice::ReadOnly))
+        return;
+    raw = f.read(FILE_HEADER_SIZE);
+    f.close();
+    isRead = true;
+    text = QTextCodec::codecForUtfText(raw, QTextCodec::codecForLocale())->toUnicode(raw);
+    if (text.startsWith(QChar(0xFEFF)))
+        text.remove(0, 1);
+    int eol = 0;
+    while (eol<text.length() && text[eol]!='\r' && text[eol]!='\n')
+        eol++;
+    firstLine = text.left(eol);
+}
+
+bool FileHeader::startsWith(const QByteArray &magic) const
+{
+    return raw.startsWith(magic);
+}
+
 FileFormat::FileFormat()
 {}
 
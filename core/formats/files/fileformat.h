@@ -14,9 +14,25 @@
 #ifndef FILEFORMAT_H
 #define FILEFORMAT_H
 
+#include <QByteArray>
 #include <QFile>
 #include "../iformat.h"
 
+// File start size, enough for detection of any format
+#define FILE_HEADER_SIZE 4096
+
+// File start, read once and shared by detectors of all formats
+struct FileHeader
+{
+    FileHeader(const QString& path);
+    QString path; // for formats, which need more than header
+    bool isRead;
+    QByteArray raw;
+    QString text; // decoded by BOM, if any, else by locale codec
+    QString firstLine;
+    bool startsWith(const QByteArray& magic) const;
+};
+
 class FileFormat : public IFormat
 {
 public:
@@ -24,6 +40,13 @@ public:
     virtual ~FileFormat();
     QStringList errors();
     QString fatalError();
+    // Detection confidence, returned by detectScore() of file formats
+    enum DetectScore {
+        NotDetected = 0,
+        WeakDetected = 10,   // may be also other format
+        LikelyDetected = 50, // only start of file is checked
+        SureDetected = 100   // signature matches
+    };
     static void lossData(QStringList& errors, const QString& contactName,
         const QString& fieldName, bool condition);
     static void lossData(QStringList& errors, const QString& contactName,
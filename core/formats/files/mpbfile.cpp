@@ -12,6 +12,7 @@
  */
 #include "mpbfile.h"
 #include <QStringList>
+#include <QThreadPool>
 
 const QString SECTION_BEGIN = QString("MyPhoneExplorer_ContentID:");
 const QString MPB_TIME_FORMAT = QString("yyyyMMddThhmmssZ");
@@ -23,12 +24,12 @@ MPBFile::MPBFile()
 
 bool MPBFile::detect(const QString &url)
 {
-    QFile f(url);
-    if (!f.open(QIODevice::ReadOnly)) return false;
-    QTextStream stream(&f);
-    QString line = stream.readLine();
-    f.close();
-    return line.contains(SECTION_BEGIN);
+    return detectScore(FileHeader(url))!=NotDetected;
+}
+
+int MPBFile::detectScore(const FileHeader &header)
+{
+    return header.firstLine.contains(SECTION_BEGIN) ? SureDetected : NotDetected;
 }
 
 QStringList MPBFile::supportedExtensions()
@@ -49,100 +50,122 @@ bool MPBFile::importRecords(const QString &url, ContactList &list, bool append)
     if (!append) // not in VCardData::importRecords; else extra data will be lost
         list.clear();
     list.extra.smsFormat = PDU;
-    // Read file
+    // Section markers are searched in raw bytes, so each section
+    // can be decoded with its own codec, without file reopening
+    QByteArray data;
+    uchar* mapped = (file.size()>0) ? file.map(0, file.size()) : 0;
+    if (mapped)
+        data = QByteArray::fromRawData((const char*)mapped, (int)file.size());
+    else
+        data = file.readAll();
+    const QByteArray secBegin = SECTION_BEGIN.toLatin1();
+    int pos = data.indexOf(secBegin);
+    // Something except section header at file start
+    if (pos==-1 || data.lastIndexOf('\n', pos)!=-1) {
+        _fatalError = QObject::tr("File isn't MPB file or corrupted");
+        closeFile();
+        return false;
+    }
     QStringList content;
-    QTextStream stream(&file);
-    enum Section {
-        secNotFound,
-        secUnknown,
-        secPhonebook,
-        secCalls,
-        secOrganizer,
-        secNotes,
-        secSMS,
-        secSMSArchive
-    };
-    Section section = secNotFound;
-    do {
-        QString line = stream.readLine();
-        // MPB section changes
-        int secPos = line.indexOf(SECTION_BEGIN);
-        if (secPos!=-1) {
-            // qDebug() << "sP " << secPos;
-            QString secName = line.mid(secPos+SECTION_BEGIN.length());
+    QThreadPool pool;
+    QList<MPBSectionTask*> tasks;
+    while (pos!=-1) {
+        // Section header line
+        int nameStart = pos+secBegin.length();
+        int nameEnd = data.indexOf('\n', nameStart);
+        int bodyStart = (nameEnd==-1) ? data.size() : nameEnd+1;
+        if (nameEnd==-1)
+            nameEnd = data.size();
+        QString secName = QString::fromLatin1(data.constData()+nameStart, nameEnd-nameStart).trimmed();
+        if (secName=="EndofData")
+            break;
+        // Section body lasts until line with next header
+        pos = data.indexOf(secBegin, bodyStart);
+        int bodyEnd = (pos==-1) ? data.size() : data.lastIndexOf('\n', pos)+1;
+        const char* body = data.constData()+bodyStart;
+        int bodySize = qMax(bodyEnd-bodyStart, 0);
+        QTextCodec* codec = sectionCodec(secName);
+        if (secName=="Model" || secName=="TimeStamp") {
+            QStringList lines = decodeLines(body, bodySize, codec);
+            QString value = lines.isEmpty() ? QString() : lines.first();
             if (secName=="Model")
-                list.extra.model = stream.readLine();
-            else if (secName=="TimeStamp")
-                list.extra.timeStamp = QDateTime::fromString(stream.readLine(), MPB_TIME_FORMAT);
-            else if (secName=="Phonebook")
-                section = secPhonebook;
-            else if (secName=="Calls")
-                section = secCalls;
-            else if (secName=="Organizer")
-                section = secOrganizer;
-            else if (secName=="Notes")
-                section = secNotes;
-            else if (secName=="SMS")
-                section = secSMS;
-            else if (secName=="SMSArchive")
-                section = secSMSArchive;
-            else if (secName=="EndofData")
-                break;
+                list.extra.model = value;
             else
-                _errors << QObject::tr("Unsupported MPB section: ") + secName;
-            if (section==secSMSArchive)
-                stream.setCodec("CP1251");
-            else if (section==secCalls)
-                stream.setCodec("UTF-8");
-        }
-        // MPB section content
-        else
-        switch (section) {
-        case secNotFound:
-            _fatalError = QObject::tr("File isn't MPB file or corrupted");
-            return false;
-        case secUnknown:
-            break;
-        case secPhonebook:
-            content << line;
-            break;
-        case secCalls: {
-            QStringList cells = line.split('\t');
-            if (cells.count()!=6)
-                _errors << QObject::tr("Strange call item: %1, size %2")
-                           .arg(line).arg(cells.count());
-            if (cells.count()>=6) {
-                CallInfo call;
-                call.cType = cells[0];
-                call.timeStamp = cells[1];
-                call.duration = cells[2];
-                call.number = cells[3];
-                call.name = cells[4];
-                list.extra.calls << call;
-            }
-            break;
+                list.extra.timeStamp = QDateTime::fromString(value, MPB_TIME_FORMAT);
         }
-        case secOrganizer:
-            list.extra.organizer << line;
-            break;
-        case secNotes:
-            list.extra.notes << line;
-            break;
-        case secSMS:
-            list.extra.SMS << line;
-            break;
-        case secSMSArchive:
-            list.extra.SMSArchive << line;
+        else if (secName=="Phonebook")
+            content = decodeLines(body, bodySize, codec);
+        else if (secName=="Calls" || secName=="Organizer" || secName=="Notes"
+                 || secName=="SMS" || secName=="SMSArchive") {
+            MPBSectionTask* task = new MPBSectionTask(secName, body, bodySize, codec);
+            tasks << task;
+            pool.start(task);
         }
-    } while (!stream.atEnd());
-    closeFile();
-    // Parse contact list
-    if (content.isEmpty()) {
+        else
+            _errors << QObject::tr("Unsupported MPB section: ") + secName;
+    }
+    // Phonebook is parsed here, while other sections are decoded in pool
+    bool res = false;
+    if (content.isEmpty())
         // TODO maybe move this string to global for other formats
         _fatalError = QObject::tr("No contact records in this file");
-        return false;
+    else
+        res = VCardData::importRecords(content, list, true, _errors);
+    pool.waitForDone();
+    foreach (MPBSectionTask* task, tasks) {
+        if (task->sectionName=="Calls") {
+            foreach (const QString& line, task->lines) {
+                QStringList cells = line.split('\t');
+                if (cells.count()!=6)
+                    _errors << QObject::tr("Strange call item: %1, size %2")
+                               .arg(line).arg(cells.count());
+                if (cells.count()>=6) {
+                    CallInfo call;
+                    call.cType = cells[0];
+                    call.timeStamp = cells[1];
+                    call.duration = cells[2];
+                    call.number = cells[3];
+                    call.name = cells[4];
+                    list.extra.calls << call;
+                }
+            }
+        }
+        else if (task->sectionName=="Organizer")
+            list.extra.organizer << task->lines;
+        else if (task->sectionName=="Notes")
+            list.extra.notes << task->lines;
+        else if (task->sectionName=="SMS")
+            list.extra.SMS << task->lines;
+        else if (task->sectionName=="SMSArchive")
+            list.extra.SMSArchive << task->lines;
+        delete task;
     }
-    return VCardData::importRecords(content, list, true, _errors);
+    closeFile();
+    return res;
+}
+
+QTextCodec* MPBFile::sectionCodec(const QString &sectionName)
+{
+    if (sectionName=="SMSArchive")
+        return QTextCodec::codecForName("CP1251"); // TODO check with various countries/locales.
+    else if (sectionName=="Model" || sectionName=="TimeStamp" || sectionName=="Phonebook")
+        return QTextCodec::codecForLocale();
+    else
+        return QTextCodec::codecForName("UTF-8");
+}
+
+QStringList MPBFile::decodeLines(const char *data, int size, QTextCodec *codec)
+{
+    QTextCodec::ConverterState state;
+    QString text = codec->toUnicode(data, size, &state);
+    QStringList lines = text.split('\n');
+    // Last line terminator isn't an empty line
+    if (!lines.isEmpty() && lines.last().isEmpty())
+        lines.removeLast();
+    for (int i=0; i<lines.count(); i++)
+        if (lines[i].endsWith('\r'))
+            lines[i].chop(1);
+    return lines;
 }
 
 bool MPBFile::exportRecords(const QString &url, ContactList &list)
@@ -269,3 +292,14 @@ void MPBFile::winEndl(QTextStream &stream)
 {
     stream << (char)13 << endl;
 }
+
+MPBSectionTask::MPBSectionTask(const QString &sectionName, const char *data, int size, QTextCodec *codec)
+    :QRunnable(), sectionName(sectionName), _data(data), _size(size), _codec(codec)
+{
+    setAutoDelete(false);
+}
+
+void MPBSectionTask::run()
+{
+    lines = MPBFile::decodeLines(_data, _size, _codec);
+}
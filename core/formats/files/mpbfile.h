@@ -14,6 +14,8 @@
 #ifndef MPBFILE_H
 #define MPBFILE_H
 
+#include <QRunnable>
+#include <QTextCodec>
 #include <QTextStream>
 
 #include "fileformat.h"
@@ -27,6 +29,7 @@ public:
     // IFormat interface
 public:
     static bool detect(const QString &url);
+    static int detectScore(const FileHeader& header);
     static QStringList supportedExtensions();
     static QStringList supportedFilters();
     bool importRecords(const QString &url, ContactList &list, bool append);
@@ -35,6 +38,23 @@ private:
     void writeSectionHeader(QTextStream& stream, const QString& sectionName,
         const char* codecAfter="UTF-8", bool writeEOL=true);
     void winEndl(QTextStream & stream);
+    static QTextCodec* sectionCodec(const QString& sectionName);
+public:
+    static QStringList decodeLines(const char* data, int size, QTextCodec* codec);
+};
+
+// One MPB section, decoded from raw file bytes in worker thread
+class MPBSectionTask : public QRunnable
+{
+public:
+    MPBSectionTask(const QString& sectionName, const char* data, int size, QTextCodec* codec);
+    void run();
+    QString sectionName;
+    QStringList lines;
+private:
+    const char* _data;
+    int _size;
+    QTextCodec* _codec;
 };
 
 #endif // MPBFILE_H
@@ -11,11 +11,14 @@
  *
  */
 
-#include <QMap>
+#include <QFileInfo>
 #include <QObject>
 #include <QStringList>
 #include <QTextCodec>
 #include <QTextStream>
+#include <QThread>
+#include <QThreadPool>
+#include "globals.h"
 #include "nbffile.h"
 #include "quazip.h"
 #include "quazipdir.h"
@@ -23,9 +26,11 @@
 #include "../common/vcarddata.h"
 
 #define NBF_VCARD_PATH QString("predefhiddenfolder/backup/WIP/32/contacts")
+#define NBF_HIDDEN_FOLDER "predefhiddenfolder/"
 #define NBF_SMS_PATH QString("predefmessages")
 #define S_ERR_SET_ARCH_ITEM QObject::tr("Can't set %1 item as current in archive")
 #define S_ERR_OPEN_ARCH_ITEM QObject::tr("Can't open %1 item in archive")
+#define NBF_COPY_BLOCK_SIZE 65536
 
 NBFFile::NBFFile()
     :FileFormat()
@@ -34,12 +39,23 @@ NBFFile::NBFFile()
 
 bool NBFFile::detect(const QString &url)
 {
-    // Check if file is zip archive and NBF_VCARD_PATH exists in archive
-    QuaZip nbf(url);
-    if (!nbf.open(QuaZip::mdUnzip))
-        return false;
+    return detectScore(FileHeader(url))!=NotDetected;
+}
+
+int NBFFile::detectScore(const FileHeader &header)
+{
+    // NBF is zip archive; first entries are usually in Nokia hidden folder
+    if (!header.startsWith(QByteArray("PK\x03\x04", 4)))
+        return NotDetected;
+    if (header.raw.contains(NBF_HIDDEN_FOLDER))
+        return SureDetected;
+    // Else vCard folder is looked for in central directory, so other
+    // zip-based files (docx, odt...) aren't NBF
+    QuaZip nbf(header.path);
+    if (header.path.isEmpty() || !nbf.open(QuaZip::mdUnzip))
+        return NotDetected;
     QuaZipDir nbd(&nbf);
-    return nbd.cd(NBF_VCARD_PATH);
+    return nbd.cd(NBF_VCARD_PATH) ? SureDetected : NotDetected;
 }
 
 QStringList NBFFile::supportedExtensions()
@@ -59,65 +75,75 @@ bool NBFFile::importRecords(const QString &url, ContactList &list, bool append)
         _fatalError = S_READ_ERR.arg(url);
         return false;
     }
-    QuaZipDir nbd(&nbf);
-    if (!nbd.cd(NBF_VCARD_PATH)) {
+    // Central directory is walked once; vCard entries are collected
+    // for workers, small SMS entries are read here
+    const QString vcfPrefix = NBF_VCARD_PATH + "/";
+    const QString smsPrefix = NBF_SMS_PATH + "/";
+    QList<int> vcfIndices;
+    QStringList vcfNames;
+    QList<BinarySMS> smsItems;
+    bool hasVCardDir = false;
+    int index = 0;
+    for (bool more=nbf.goToFirstFile(); more; more=nbf.goToNextFile(), index++) {
+        QString fileName = nbf.getCurrentFileName();
+        // DON'T replace / to QDir::separator(), it may not work on Windows!
+        if (fileName.startsWith(vcfPrefix)) {
+            hasVCardDir = true;
+            QString itemID = fileName.mid(vcfPrefix.length());
+            if (!itemID.isEmpty() && !itemID.contains("/")) {
+                vcfIndices << index;
+                vcfNames << fileName;
+            }
+        }
+        else if (fileName.startsWith(smsPrefix) && !fileName.endsWith("/")
+                 && fileName.mid(smsPrefix.length()).count("/")==1) {
+            QString itemID = fileName.section("/", -1);
+            QuaZipFile smsf(&nbf);
+            if (!smsf.open(QIODevice::ReadOnly)) {
+                _errors << S_ERR_OPEN_ARCH_ITEM.arg(fileName.mid(smsPrefix.length()));
+                continue;
+            }
+            BinarySMS sms;
+            sms.name = itemID;
+            sms.content = smsf.read(smsf.size());
+            smsItems << sms;
+        }
+    }
+    nbf.close();
+    if (!hasVCardDir) {
         _fatalError = QObject::tr("Can't open %1 directory in archive").arg(NBF_VCARD_PATH);
-        nbf.close();
         return false;
     }
     // Each contact is a single vcf in NBF_VCARD_PATH inside archive
     if (!append) list.clear(); // VCardData::importRecords must be called with append=true
     list.originalPath = url;
-    foreach (const QString& itemID, nbd.entryList()) {
-        // DON'T replace / to QDir::separator(), it may not work on Windows!
-        if (!nbf.setCurrentFile(NBF_VCARD_PATH + "/" + itemID)) {
-            _errors << S_ERR_SET_ARCH_ITEM.arg(itemID);
-            continue;
-        }
-        // Open contact pseudo-file
-        QuaZipFile vcf(&nbf);
-        if (!vcf.open(QIODevice::ReadOnly)) {
-            _errors << S_ERR_OPEN_ARCH_ITEM.arg(itemID);
-            continue;
-        }
-        QTextStream stream(&vcf);
-        QStringList content;
-        while (!stream.atEnd())
-            content << stream.readLine();
-        vcf.close();
-        // Append one contact to list!
-        VCardData::importRecords(content, list, true, _errors);
-        list.last().originalFormat = "NBF";
+    list.extra.binarySMS << smsItems;
+    // Contiguous ranges keep archive order on merge
+    QThreadPool pool;
+    int taskCount = 1;
+    if (QThread::idealThreadCount()>1 && !gd.debugSave) // log file isn't thread-safe
+        taskCount = qBound(1, vcfIndices.count()/NBF_IMPORT_MIN_BATCH, pool.maxThreadCount());
+    QList<NBFImportTask*> tasks;
+    for (int i=0; i<taskCount; i++) {
+        NBFImportTask* task = new NBFImportTask(url);
+        int from = vcfIndices.count()*i/taskCount;
+        int to = vcfIndices.count()*(i+1)/taskCount;
+        task->indices = vcfIndices.mid(from, to-from);
+        task->names = vcfNames.mid(from, to-from);
+        tasks << task;
+        if (taskCount==1)
+            task->run();
+        else
+            pool.start(task);
     }
-    // SMS
-    QuaZipDir nbds(&nbf);
-    if (nbds.cd(NBF_SMS_PATH)) {
-        QStringList subDirs = nbds.entryList();
-        foreach (const QString& dirID, subDirs) {
-            if (dirID.endsWith("/")) // entryList() contains both "5" and "5/" dirnames
-                continue; // TODO check on Linux
-            // DON'T replace / to QDir::separator(), it may not work on Windows!
-            QuaZipDir nbdss(&nbf);
-            nbdss.cd(NBF_SMS_PATH + "/" + dirID);
-            foreach (const QString& itemID, nbdss.entryList()) {
-                if (!nbf.setCurrentFile(NBF_SMS_PATH + "/" + dirID+ "/" + itemID)) {
-                    _errors << S_ERR_SET_ARCH_ITEM.arg(dirID+ "/" + itemID);
-                    continue;
-                }
-                QuaZipFile smsf(&nbf);
-                if (!smsf.open(QIODevice::ReadOnly)) {
-                    _errors << S_ERR_OPEN_ARCH_ITEM.arg(dirID+ "/" + itemID);
-                    continue;
-                }
-                BinarySMS sms;
-                sms.name = itemID;
-                sms.content = smsf.read(smsf.size());
-                list.extra.binarySMS << sms;
-            }
-        }
+    pool.waitForDone();
+    foreach (NBFImportTask* task, tasks) {
+        for (int i=0; i<task->items.count(); i++)
+            list.appendSwapped(task->items[i]);
+        _errors << task->errors;
+        delete task;
     }
     // TODO calls
-    nbf.close();
     return true;
 }
 
@@ -135,22 +161,33 @@ bool NBFFile::exportRecords(const QString &url, ContactList &list)
         _fatalError = QObject::tr("Original NBF file was moved or deleted");
         return false;
     }
-    // Unpack original archive
+    // Original archive is read while new one is written, so it can't be
+    // overwritten in place
+    QString outPath = url;
+    bool sameFile = (QFileInfo(url).absoluteFilePath()==QFileInfo(list.originalPath).absoluteFilePath());
+    if (sameFile)
+        outPath = url + ".new";
     QuaZip nbf(list.originalPath);
     if (!nbf.open(QuaZip::mdUnzip)) {
         _fatalError = S_READ_ERR.arg(list.originalPath);
         return false;
     }
     // Archive properties
-    bool is64 = nbf.isZip64Enabled();
+    QuaZip outNbf(outPath);
+    outNbf.setZip64Enabled(nbf.isZip64Enabled());
+    outNbf.setFileNameCodec(nbf.getFileNameCodec());
+    outNbf.setCommentCodec(nbf.getCommentCodec());
+    if (!outNbf.open(QuaZip::mdCreate)) {
+        _fatalError = S_WRITE_ERR.arg(url);
+        nbf.close();
+        return false;
+    }
     QString arComment = nbf.getComment();
-    QTextCodec* fnCodec = nbf.getFileNameCodec();
-    QTextCodec* commCodec = nbf.getCommentCodec();
-    // Read entire archive
-    QMap<QString, QByteArray> arFiles;
-    QMap<QString, QuaZipFileInfo64> arInfo;
-    nbf.goToFirstFile();
-    do {
+    if (!arComment.isEmpty())
+        outNbf.setComment(arComment);
+    // Copy all unchanged entries as is, without recompression
+    QByteArray buf;
+    for (bool more=nbf.goToFirstFile(); more; more=nbf.goToNextFile()) {
         QString fileName = nbf.getCurrentFileName();
         QuaZipFileInfo64 info;
         nbf.getCurrentFileInfo(&info);
@@ -160,37 +197,26 @@ bool NBFFile::exportRecords(const QString &url, ContactList &list)
         // Skip if fileName is *.vcf
         if (fileName.endsWith(".vcf", Qt::CaseInsensitive))
             continue;
+        int method, level;
         QuaZipFile f(&nbf);
-        if (f.open(QIODevice::ReadOnly)) {
-            arFiles[fileName] = f.readAll();
-            f.close();
-        }
-        else
+        if (!f.open(QIODevice::ReadOnly, &method, &level, true)) {
             _errors << S_ERR_OPEN_ARCH_ITEM.arg(fileName);
-        arInfo[fileName] = info;
-    } while (nbf.goToNextFile());
-    nbf.close();
-    // Write modified archive
-    nbf.setZipName(url);
-    nbf.setZip64Enabled(is64);
-    nbf.setFileNameCodec(fnCodec);
-    nbf.setCommentCodec(commCodec);
-    if (!nbf.open(QuaZip::mdCreate)) {
-        _fatalError = S_WRITE_ERR.arg(url);
-        return false;
-    }
-    if (!arComment.isEmpty())
-        nbf.setComment(arComment);
-    foreach (const QString fileName, arFiles.keys()) {
-        QuaZipFile f(&nbf);
+            continue;
+        }
+        QuaZipFile outF(&outNbf);
         // TODO attrs!
-        if (f.open(QIODevice::WriteOnly, QuaZipNewInfo(arInfo[fileName]))) {
-            f.write(arFiles[fileName]);
-            f.close();
+        if (outF.open(QIODevice::WriteOnly, QuaZipNewInfo(info), NULL, info.crc, method, level, true)) {
+            while (!(buf = f.read(NBF_COPY_BLOCK_SIZE)).isEmpty())
+                outF.write(buf);
+            outF.close();
+            if (outF.getZipError()!=ZIP_OK)
+                _errors << S_ERR_OPEN_ARCH_ITEM.arg(fileName);
         }
         else
             _errors << S_ERR_OPEN_ARCH_ITEM.arg(fileName);
+        f.close();
     }
+    nbf.close();
     // Add vcf files
     VCardData data;
     int i = 1;
@@ -198,7 +224,7 @@ bool NBFFile::exportRecords(const QString &url, ContactList &list)
         QStringList lines;
         data.exportRecord(lines, item, _errors);
         QString fileName = QString("/%1.vcf").arg(i);
-        QuaZipFile f(&nbf);
+        QuaZipFile f(&outNbf);
         if (f.open(QIODevice::WriteOnly,
                    QuaZipNewInfo(NBF_VCARD_PATH + fileName)))
         {
@@ -212,7 +238,66 @@ bool NBFFile::exportRecords(const QString &url, ContactList &list)
         i++;
     }
     // Done
-    nbf.close();
+    outNbf.close();
+    if (outNbf.getZipError()!=ZIP_OK) {
+        _fatalError = S_WRITE_ERR.arg(url);
+        return false;
+    }
+    if (sameFile) {
+        QFile::remove(url);
+        if (!QFile::rename(outPath, url)) {
+            _fatalError = S_WRITE_ERR.arg(url);
+            return false;
+        }
+    }
     return true;
 }
 
+NBFImportTask::NBFImportTask(const QString &url)
+    :QRunnable(), _url(url)
+{
+    setAutoDelete(false);
+}
+
+void NBFImportTask::run()
+{
+    if (indices.isEmpty())
+        return;
+    QuaZip nbf(_url);
+    if (!nbf.open(QuaZip::mdUnzip)) {
+        errors << S_READ_ERR.arg(_url);
+        return;
+    }
+    VCardData reader;
+    // Walk directory up to each entry; it's cheaper than name lookup
+    int index = 0;
+    bool more = nbf.goToFirstFile();
+    for (int i=0; i<indices.count(); i++) {
+        while (more && index<indices[i]) {
+            more = nbf.goToNextFile();
+            index++;
+        }
+        QString itemID = names[i].section("/", -1);
+        if (!more || nbf.getCurrentFileName()!=names[i]) {
+            errors << S_ERR_SET_ARCH_ITEM.arg(itemID);
+            continue;
+        }
+        // Open contact pseudo-file
+        QuaZipFile vcf(&nbf);
+        if (!vcf.open(QIODevice::ReadOnly)) {
+            errors << S_ERR_OPEN_ARCH_ITEM.arg(itemID);
+            continue;
+        }
+        QTextStream stream(&vcf);
+        QStringList content;
+        while (!stream.atEnd())
+            content << stream.readLine();
+        vcf.close();
+        // Append one contact to list!
+        int oldCount = items.count();
+        reader.importRecords(content, items, true, errors);
+        if (items.count()>oldCount)
+            items.last().originalFormat = "NBF";
+    }
+    nbf.close();
+}
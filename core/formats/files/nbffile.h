@@ -14,6 +14,7 @@
 #ifndef NBFFILE_H
 #define NBFFILE_H
 
+#include <QRunnable>
 #include "fileformat.h"
 #include "../common/vcarddata.h"
 
@@ -25,10 +26,29 @@ public:
     // IFormat interface
 public:
     static bool detect(const QString &url);
+    static int detectScore(const FileHeader& header);
     static QStringList supportedExtensions();
     static QStringList supportedFilters();
     bool importRecords(const QString &url, ContactList &list, bool append);
     bool exportRecords(const QString &url, ContactList &list);
 };
 
+// Least count of vCard entries for one parallel import task
+#define NBF_IMPORT_MIN_BATCH 64
+
+// Contiguous range of vCard entries, inflated and parsed in worker thread
+// through its own archive handle
+class NBFImportTask : public QRunnable
+{
+public:
+    NBFImportTask(const QString& url);
+    void run();
+    QList<int> indices; // positions in central directory, ascending
+    QStringList names;
+    ContactList items;
+    QStringList errors;
+private:
+    QString _url;
+};
+
 #endif // NBFFILE_H
@@ -14,9 +14,12 @@
  *
  */
 
-#include <QtAlgorithms>
-#include <QDataStream>
+#include <QDebug>
 #include <QFile>
+#include <QThreadPool>
+#include <QtEndian>
+#include <zlib.h>
+#include "globals.h"
 #include "nbufile.h"
 
 #define SUMMARY_OFFSET_OFFSET 0x00000014
@@ -24,6 +27,9 @@
 #define S_UNSUPPORTED_SECTION QObject::tr("Unsupported NBU file section type: %1")
 #define S_UNSUPPORTED_FOLDER QObject::tr("Unsupported NBU file folder type: %1")
 
+// Parser tracing for format investigation; silent unless debug save is on
+#define NBU_TRACE(msg) do { if (gd.debugSave) qDebug() << msg; } while (0)
+
 const QString ptContacts = "Contacts";
 const QString ptGroups = "Groups";
 const QString ptBookmarks = "Bookmarks";
@@ -120,21 +126,151 @@ NBUSectionType::Sbackup, ptSettings, "Backup",}
 
 };
 
+NBUCursor::NBUCursor(const char *data, qint64 size)
+    :_data((const uchar*)data), _size(size), _pos(0), _failed(false)
+{
+}
+
+qint64 NBUCursor::pos() const
+{
+    return _pos;
+}
+
+qint64 NBUCursor::size() const
+{
+    return _size;
+}
+
+bool NBUCursor::failed() const
+{
+    return _failed;
+}
+
+bool NBUCursor::atEnd() const
+{
+    return _pos>=_size;
+}
+
+bool NBUCursor::seek(qint64 newPos)
+{
+    if (newPos<0 || newPos>_size) {
+        _failed = true;
+        return false;
+    }
+    _pos = newPos;
+    return true;
+}
+
+NBUCursor NBUCursor::at(qint64 newPos) const
+{
+    NBUCursor res((const char*)_data, _size);
+    res.seek(newPos);
+    return res;
+}
+
+bool NBUCursor::skip(qint64 count)
+{
+    return seek(_pos+count);
+}
+
+quint8 NBUCursor::getU8()
+{
+    if (!ensure(1))
+        return 0;
+    return _data[_pos++];
+}
+
+quint16 NBUCursor::getU16()
+{
+    if (!ensure(2))
+        return 0;
+    quint16 res = qFromLittleEndian<quint16>(_data+_pos);
+    _pos += 2;
+    return res;
+}
+
+quint32 NBUCursor::getU32()
+{
+    if (!ensure(4))
+        return 0;
+    quint32 res = qFromLittleEndian<quint32>(_data+_pos);
+    _pos += 4;
+    return res;
+}
+
+quint64 NBUCursor::getU64()
+{
+    if (!ensure(8))
+        return 0;
+    quint64 res = qFromLittleEndian<quint64>(_data+_pos);
+    _pos += 8;
+    return res;
+}
+
+QString NBUCursor::getString16c()
+{
+    quint16 cnt = getU16();
+    return getString16(2*cnt);
+}
+
+QString NBUCursor::getString16(qint64 byteLen)
+{
+    if (!ensure(byteLen))
+        return QString();
+    // Data may be unaligned, so characters are assembled one by one
+    QString res;
+    res.resize(byteLen/2);
+    for (int i=0; i<res.length(); i++)
+        res[i] = QChar(qFromLittleEndian<quint16>(_data+_pos+2*i));
+    _pos += byteLen;
+    return res;
+}
+
+QDateTime NBUCursor::getDateTime()
+{
+    // NBU use swapped Windows file time
+    quint64 high = getU32();
+    quint64 low = getU32();
+    QDateTime winEpoch(QDate(1601, 1, 1), QTime(0, 0, 0));
+    return winEpoch.addMSecs(((high<<32) | low)/10000);
+}
+
+QByteArray NBUCursor::getSlice(qint64 len)
+{
+    // QByteArray size is int
+    if (len>0x7FFFFFFF)
+        _failed = true;
+    if (!ensure(len))
+        return QByteArray();
+    QByteArray res = QByteArray::fromRawData((const char*)_data+_pos, int(len));
+    _pos += len;
+    return res;
+}
+
+bool NBUCursor::ensure(qint64 count)
+{
+    if (_failed || count<0 || _pos+count>_size) {
+        _failed = true;
+        return false;
+    }
+    return true;
+}
+
 NBUFile::NBUFile()
     :FileFormat()
 {
 }
 
 bool NBUFile::detect(const QString &url)
+{
+    return detectScore(FileHeader(url))!=NotDetected;
+}
+
+int NBUFile::detectScore(const FileHeader &header)
 {
     // Check 4 first bytes as signature
-    QFile f(url);
-    if (!f.open(QIODevice::ReadOnly)) return false;
-    QDataStream ss(&f);
-    ss.setByteOrder(QDataStream::LittleEndian);
-    quint32 sig = getU32(ss);
-    f.close();
-    return (sig==0xFC3352cc);
+    NBUCursor cursor(header.raw.constData(), qMin(header.raw.size(), 4));
+    return (cursor.getU32()==0xFC3352cc && !cursor.failed()) ? SureDetected : NotDetected;
 }
 
 QStringList NBUFile::supportedExtensions()
@@ -147,7 +283,6 @@ QStringList NBUFile::supportedFilters()
     return (QStringList() << "Nokia NBU (*.nbu *.NBU)");
 }
 
-#include <iostream>
 bool NBUFile::importRecords(const QString &url, ContactList &list, bool append)
 {
     if (!detect(url))
@@ -156,174 +291,89 @@ bool NBUFile::importRecords(const QString &url, ContactList &list, bool append)
         return false;
     if (!append)
         list.clear();
-    QDataStream ss(&file);
-    ss.setByteOrder(QDataStream::LittleEndian);
-    if (!file.seek(SUMMARY_OFFSET_OFFSET)) {
-        _fatalError = S_SEEK_ERR.arg(SUMMARY_OFFSET_OFFSET);
+    // Backups may be very large, so file is mapped rather than read, if possible
+    QByteArray content;
+    qint64 size = file.size();
+    uchar* mapped = (size>0) ? file.map(0, size) : 0;
+    if (!mapped) {
+        content = file.readAll();
+        size = content.size();
+    }
+    NBUCursor cursor(mapped ? (const char*)mapped : content.constData(), size);
+    if (!cursor.seek(SUMMARY_OFFSET_OFFSET)) {
+        _fatalError = S_SEEK_ERR.arg(SUMMARY_OFFSET_OFFSET).arg(url);
         closeFile();
         return false;
     }
-    quint64 sumOffset = getU64(ss);
-    if (!file.seek(sumOffset+SUMMARY_OFFSET)) {
-        _fatalError = S_SEEK_ERR.arg(sumOffset+SUMMARY_OFFSET);
+    quint64 sumOffset = cursor.getU64();
+    if (!cursor.seek(sumOffset+SUMMARY_OFFSET)) {
+        _fatalError = S_SEEK_ERR.arg(sumOffset+SUMMARY_OFFSET).arg(url);
         closeFile();
         return false;
     }
     // Common NBU attributes
-    list.extra.timeStamp = getDateTime(ss);
-    list.extra.imei = getString16c(ss);
-    list.extra.model = getString16c(ss); // name, then model
-    list.extra.model = getString16c(ss) + " " + list.extra.model;
-    list.extra.firmware = getString16c(ss);
-    list.extra.phoneLang = getString16c(ss);
+    list.extra.timeStamp = cursor.getDateTime();
+    list.extra.imei = cursor.getString16c();
+    list.extra.model = cursor.getString16c(); // name, then model
+    list.extra.model = cursor.getString16c() + " " + list.extra.model;
+    list.extra.firmware = cursor.getString16c();
+    list.extra.phoneLang = cursor.getString16c();
     list.extra.smsFormat = VMSG;
     // NBU sections
-    if (!file.seek(file.pos()+  0x14  )) {
-        _fatalError = S_SEEK_ERR.arg(file.pos()+  0x14  );
+    if (!cursor.skip(0x14)) {
+        _fatalError = S_SEEK_ERR.arg(cursor.pos()+0x14).arg(url);
         closeFile();
         return false;
     }
-    // Read sections
-    quint32 sectCount = getU32(ss);
-std::cout << "sections: " << sectCount << std::endl; //===>
-    for (quint32 i=0; i<sectCount; i++) {
-        quint8 sectID[NBU_SECT_ID_SIZE];
-        ss.readRawData((char*)sectID, sizeof(sectID));
-        quint64 sectStart = getU64(ss);
-        if (!file.seek(file.pos()+8)) {
-            _errors << S_SEEK_ERR.arg(file.pos()+8);
-            closeFile();
-            return true; // Partial read?
-        }
-        NBUSectionType* section = findSectionType(sectID);
-        if (!section) {
-            /*
-            _fatalError = QObject::tr("Unknown NBU file section type");
-            closeFile();
-            return false;*/
-            _errors << QObject::tr("Unknown NBU file section type");
-            continue;
-        }        
-        quint32 count, count2;
-        quint64 partPos;
-        QString folderName;
-std::cout << "Section: " << section->type << "::" << section->name.toLocal8Bit().data() << "::" << section->name2.toLocal8Bit().data() << std::endl;
-        switch (section->type) {
-        /*case ProcessType.FileSystem: TODO*/
-        case NBUSectionType::Vcards:
-            ss >> count >> count2;
-std::cout << "VCards " << count << "!"<< count2 << std::endl;
-            if (count2>0) {
-                for (quint32 j = 0; j < count2; j++) {
-                    file.seek(file.pos()+4); //folder id
-                    quint64 folderAddr = getU64(ss);
-                    partPos = file.pos();
-                    file.seek(folderAddr + 4);
-                    folderName = getString16c(ss);
-std::cout << folderAddr << " >> " << folderName.toLocal8Bit().data() << std::endl;
-                    if (!parseFolderVcard(ss, list, section->name)) {
-                        _errors << QObject::tr("Unknown vcard folder structure at section %1, subsection %2")
-                            .arg(i).arg(j);
-                    }
-                    file.seek(partPos);
-                }
+    // Whole section table is read first, then only needed sections are decoded
+    QList<NBUSectionIndex> sections;
+    if (!readSectionIndex(cursor, sections))
+        _errors << S_SEEK_ERR.arg(cursor.pos()).arg(url); // Partial read?
+    // Contacts go first, because groups refer to contact indexes
+    int firstContact = list.count();
+    foreach (const NBUSectionIndex& section, sections) {
+        NBU_TRACE("Section:" << section.type->type << section.type->name << section.type->name2);
+        switch (section.type->type) {
+        case NBUSectionType::Vcards: {
+            if (section.type->name!=ptContacts) {
+                NBU_TRACE("Skipped (not requested)");
+                break;
             }
-            else {
-std::cout << "No vcard folders" << std::endl;
-                quint64 partPos = file.pos();
-                file.seek(sectStart + 0x2C);
-                if (!parseFolderVcard(ss, list, section->name)) {
+            NBU_TRACE("VCards" << section.count << section.folders.count());
+            if (section.folders.isEmpty()) {
+                NBUCursor c = cursor.at(section.start + 0x2C);
+                if (!parseFolderVcard(c, list, section.type->name))
                     _errors << QObject::tr("Unknown vcard folder structure at section %1, subsection %2")
-                        .arg(i).arg("0");
-                }
-                file.seek(partPos);
+                        .arg(section.number).arg("0");
+            }
+            for (int j=0; j<section.folders.count(); j++) {
+                NBUCursor c = cursor.at(section.folders[j] + 4);
+                QString folderName = c.getString16c();
+                NBU_TRACE(section.folders[j] << ">>" << folderName);
+                if (!parseFolderVcard(c, list, section.type->name))
+                    _errors << QObject::tr("Unknown vcard folder structure at section %1, subsection %2")
+                        .arg(section.number).arg(j);
             }
             break;
+        }
+        /*case ProcessType.FileSystem: TODO*/
         /*case ProcessType.Memos: TODO*/
         case NBUSectionType::Groups:
-            ss >> count2 >> count;
-            std::cout << "Groups " << count << "!"<< count2 << std::endl;
-            for (quint32 j = 0; j < count; j++)
-            {
-                file.seek(file.pos() + 4);
-                quint64 start = getU64(ss);
-                partPos = file.pos();
-                file.seek(start + 4);
-                folderName = getString16c(ss);
-                ss >> count2;
-                std::cout << " contacts in group " << count2 << std::endl;
-                if (!list.isEmpty())
-                {
-                    for (quint32 k = 0; k < count2; k++)
-                    {
-                        quint32 ix = getU32(ss); // contact index, from 1
-                        if ((quint32)list.count() >= ix) {
-                            ContactItem& item = list[ix - 1];
-                            item.groups << folderName;
-                        }
-                        else
-                            _errors << QObject::tr("Invalid index: %1").arg(ix);
-                    }
-                }
-                file.seek(partPos);
-            }
-            break;
         case NBUSectionType::GeneralFolders:
         case NBUSectionType::Sbackup:
-        {
-            ss >> count2 >> count;
-            partPos = file.pos();
-            QString zipTest = "";
-            //long tmpCnt = StreamUtils.Counter;
-            if (!file.seek(sectStart + 73)) {
-                _fatalError = S_SEEK_ERR.arg(sectStart + 73);
-                closeFile();
-                return false;
-            }
-            zipTest = getString16c(ss);
-//            StreamUtils.Counter = tmpCnt;
-            if (zipTest == "application/vnd.nokia-backup")
-            {
-                _errors << S_UNSUPPORTED_SECTION.arg(zipTest); // TODO
-                return true; //===>
-                /*
-                           long zipOffset = file.pos();
-                ZipInputStream zi = new ZipInputStream(fs);
-                zi.IsStreamOwner = false;
-                parseFolderZip(currentFileName, zi, zipOffset, sect.name);
-                fs.Seek(partPos, SeekOrigin.Begin);*/
-
-            }
-            else if (section->name2 == "Messages" && count == 0)
-            {
-                _errors << S_UNSUPPORTED_SECTION.arg(zipTest); // TODO
-                return true; //===>
-                /*
-                file.seek(sectStart);
-                parseBinaryMessages(currentFileName, fs);
-                file.seek(partPos);
-                */
-            }
-            else
-            {
-                file.seek(partPos);
-                std::cout << "Folders " << count << "!"<< count2 << std::endl;
-                for (quint32 j = 0; j < count; j++)
-                {
-                    file.seek(file.pos() + 4);
-                    quint64 start = getU64(ss);
-                    partPos = file.pos();
-                    parseFolder(ss, start, section->name, list);
-                    file.seek(partPos);
-                }
-            }
-            break;
-        }
+            break; // see below
         default:
-            _errors << S_UNSUPPORTED_SECTION.arg(section->name);
-        } // switch section type
+            _errors << S_UNSUPPORTED_SECTION.arg(section.type->name);
+        }
     }
-    std::cout << "sections completed " << std::endl; //===>
+    foreach (const NBUSectionIndex& section, sections)
+        if (section.type->type==NBUSectionType::Groups)
+            parseGroups(cursor, section, list, firstContact);
+    foreach (const NBUSectionIndex& section, sections)
+        if (section.type->type==NBUSectionType::GeneralFolders
+                || section.type->type==NBUSectionType::Sbackup)
+            parseGeneralSection(cursor, section, list);
+    NBU_TRACE("sections completed");
     closeFile();
     return true;
 }
@@ -333,54 +383,7 @@ bool NBUFile::exportRecords(const QString &, ContactList &)
     return false;
 }
 
-QDateTime NBUFile::getDateTime(QDataStream &stream)
-{
-    // NBU use swapped Windows file time
-    union TimeAs64 {
-        quint64 value;
-        struct {
-            quint32 low, high;
-        };
-    } tm;
-    stream >> tm.value;
-    qSwap(tm.low, tm.high);
-    QDateTime winEpoch(QDate(1601, 1, 1), QTime(0, 0, 0));
-    return winEpoch.addMSecs(tm.value/10000);
-}
-
-QString NBUFile::getString16c(QDataStream& stream)
-{
-    quint16 cnt;
-    stream >> cnt;
-    ushort* raw = new ushort[cnt];
-    stream.readRawData((char*)raw, 2*cnt);
-    QString res = QString::fromUtf16(raw, cnt);
-    delete raw;
-    return res;
-}
-
-quint64 NBUFile::getU64(QDataStream &stream)
-{
-    quint64 res;
-    stream >> res;
-    return res;
-}
-
-quint32 NBUFile::getU32(QDataStream &stream)
-{
-    quint32 res;
-    stream >> res;
-    return res;
-}
-
-quint8 NBUFile::getU8(QDataStream &stream)
-{
-    quint8 res;
-    stream >> res;
-    return res;
-}
-
-NBUSectionType *NBUFile::findSectionType(quint8 *sectID)
+NBUSectionType *NBUFile::findSectionType(const quint8 *sectID)
 {
     for(unsigned int i=0; i<sizeof(nbuSectionTypes)/sizeof(NBUSectionType); i++) {
         NBUSectionType* cand = &nbuSectionTypes[i];
@@ -396,90 +399,175 @@ NBUSectionType *NBUFile::findSectionType(quint8 *sectID)
     return 0;
 }
 
-bool NBUFile::parseFolderVcard(QDataStream &stream, ContactList &list, const QString &sectName)
+bool NBUFile::readSectionIndex(NBUCursor &cursor, QList<NBUSectionIndex> &sections)
 {
-    quint32 count = getU32(stream);
+    quint32 sectCount = cursor.getU32();
+    NBU_TRACE("sections:" << sectCount);
+    for (quint32 i=0; i<sectCount && !cursor.failed(); i++) {
+        quint8 sectID[NBU_SECT_ID_SIZE];
+        for (int j=0; j<NBU_SECT_ID_SIZE; j++)
+            sectID[j] = cursor.getU8();
+        NBUSectionIndex section;
+        section.number = i;
+        section.start = cursor.getU64();
+        section.count = 0;
+        cursor.skip(8);
+        section.type = findSectionType(sectID);
+        if (!section.type) {
+            _errors << QObject::tr("Unknown NBU file section type");
+            continue;
+        }
+        // Folder address table follows only some section types
+        quint32 folderCount = 0;
+        switch (section.type->type) {
+        case NBUSectionType::Vcards:
+        case NBUSectionType::Groups:
+        case NBUSectionType::GeneralFolders:
+        case NBUSectionType::Sbackup:
+            section.count = cursor.getU32();
+            folderCount = cursor.getU32();
+            break;
+        default:
+            break;
+        }
+        for (quint32 j=0; j<folderCount && !cursor.failed(); j++) {
+            cursor.skip(4); // folder id
+            section.folders << cursor.getU64();
+        }
+        sections << section;
+    }
+    return !cursor.failed();
+}
+
+bool NBUFile::parseFolderVcard(NBUCursor &cursor, ContactList &list, const QString &sectName)
+{
+    quint32 count = cursor.getU32();
     // Valid sect names for vCard: Contacts, Bookmarks, Calendar
     if (sectName!=ptContacts && sectName!=ptBookmarks && sectName!="Calendar") {
         _errors << S_UNSUPPORTED_SECTION.arg(sectName);
         return false;
     }
-    for (quint32 i = 0; i < count; i++)
+    // All folder records are imported at once
+    QStringList content;
+    for (quint32 i = 0; i < count && !cursor.failed(); i++)
     {
-        quint32 test = getU32(stream);
+        quint32 test = cursor.getU32();
         if (test == 0x10)
         {
-            stream >> test;
+            test = cursor.getU32();
             if (test > 1)
                 _errors << QObject::tr("Test 2 greater than 0x01: %1").arg(test, 0, 16);
         }
         else
             _errors << QObject::tr("Test 1 different than 0x10: %1").arg(test, 0, 16);
-        int vcLen = getU32(stream);
-        char* raw = new char[vcLen];
-        stream.readRawData((char*)raw, vcLen);
-        QString vCard = QString::fromUtf8(raw, vcLen);
-        QStringList content = vCard.split("\x0d\n");
-        VCardData::importRecords(content, list, true, _errors);
-        delete raw;
-        list.last().originalFormat = "NBU";
+        quint32 vcLen = cursor.getU32();
+        QByteArray raw = cursor.getSlice(vcLen);
+        content << QString::fromUtf8(raw.constData(), raw.size()).split("\x0d\n");
     }
+    if (cursor.failed())
+        return false;
+    int firstItem = list.count();
+    VCardData::importRecords(content, list, true, _errors);
+    for (int i=firstItem; i<list.count(); i++)
+        list[i].originalFormat = "NBU";
     return true;
 }
 
-bool NBUFile::parseFolder(QDataStream &stream, long start, const QString &sectName, ContactList &list)
+void NBUFile::parseGroups(const NBUCursor &content, const NBUSectionIndex &section, ContactList &list, int firstContact)
 {
-    std::cout << "folder: " << sectName.toLocal8Bit().data() << std::endl;
-    if(sectName==ptMessages || sectName==ptMms) {
-        file.seek(start+4);
-        QString folderName = this->getString16c(stream);
-        quint32 count = getU32(stream);
-std::cout << "Messages " << count << "!"<< folderName.toLocal8Bit().data() << std::endl;
-        for (quint32 i=0; i<count; i++) {
-            file.seek(file.pos()+8);
-            if (sectName==ptMms) {
-                _errors << S_UNSUPPORTED_FOLDER.arg(sectName);
-                // TODO
+    NBU_TRACE("Groups" << section.folders.count() << section.count);
+    foreach (quint64 start, section.folders) {
+        NBUCursor cursor = content.at(start + 4);
+        QString folderName = cursor.getString16c();
+        quint32 count = cursor.getU32();
+        NBU_TRACE("contacts in group" << count);
+        if (list.count()==firstContact)
+            continue;
+        for (quint32 k = 0; k < count && !cursor.failed(); k++)
+        {
+            quint32 ix = cursor.getU32(); // contact index, from 1
+            if (ix>0 && (quint32)(list.count()-firstContact) >= ix) {
+                ContactItem& item = list[firstContact + ix - 1];
+                item.groups << folderName;
             }
-            else {
-                quint32 len = getU32(stream);
-                char* raw = new char[len+2];
-                stream.readRawData((char*)raw, len);
-                raw[len] = 0;
-                raw[len+1] = 0;
-                QString msg = QString::fromUtf16((ushort*)raw);
+            else
+                _errors << QObject::tr("Invalid index: %1").arg(ix);
+        }
+        if (cursor.failed())
+            _errors << S_SEEK_ERR.arg(start).arg(file.fileName());
+    }
+}
+
+void NBUFile::parseGeneralSection(const NBUCursor &content, const NBUSectionIndex &section, ContactList &list)
+{
+    NBUCursor cursor = content.at(section.start + 73);
+    if (cursor.failed()) {
+        _errors << S_SEEK_ERR.arg(section.start + 73).arg(file.fileName());
+        return;
+    }
+    QString zipTest = cursor.getString16c();
+    if (zipTest == "application/vnd.nokia-backup")
+        _errors << S_UNSUPPORTED_SECTION.arg(zipTest); // TODO parseFolderZip
+    else if (section.type->name2 == "Messages" && section.folders.isEmpty())
+        _errors << S_UNSUPPORTED_SECTION.arg(zipTest); // TODO parseBinaryMessages
+    else if (section.type->name==ptMms)
+        _errors << S_UNSUPPORTED_FOLDER.arg(ptMms); // TODO
+    else
+    {
+        NBU_TRACE("Folders" << section.folders.count() << section.count);
+        foreach (quint64 start, section.folders)
+            parseFolder(content, start, section.type->name, list);
+    }
+}
+
+bool NBUFile::parseFolder(const NBUCursor &content, quint64 start, const QString &sectName, ContactList &list)
+{
+    NBU_TRACE("folder:" << sectName);
+    if (sectName==ptMessages) {
+        NBUCursor cursor = content.at(start+4);
+        QString folderName = cursor.getString16c();
+        quint32 count = cursor.getU32();
+        NBU_TRACE("Messages" << count << folderName);
+        for (quint32 i=0; i<count && !cursor.failed(); i++) {
+            cursor.skip(8);
+            quint32 len = cursor.getU32();
+            QString msg = cursor.getString16(len & ~1);
+            cursor.skip(len & 1);
+            // Message is zero-terminated inside its record
+            int zeroPos = msg.indexOf(QChar(0));
+            if (zeroPos!=-1)
+                msg.truncate(zeroPos);
+            if (!cursor.failed())
                 list.extra.SMS << msg;
-                delete raw;
-            }
         }
-        return true;
+        return !cursor.failed();
     }
     else {
-        file.seek(start);
-        quint32 tst = getU32(stream);
-std::cout << "tst=0x" << std::hex << tst << std::dec << std::endl;
+        NBUCursor cursor = content.at(start);
+        quint32 tst = cursor.getU32();
+        NBU_TRACE("tst=" << QString::number(tst, 16));
         bool procAsDefault = false;
         switch (tst)
         {
         case 0x0301: // contacts
-            parseContacts(stream);
+            // Currently this is a duplicate of vCard records, so parsed only to trace
+            if (gd.debugSave)
+                parseContacts(cursor);
             break;
         case 0x0303: // messages
         case 0x0304: // messages
             procAsDefault = true;
             break;
         case 0x1001: // S60 compressed files
-            std::cout << "S60 compressed files" << std::endl;
-            std::cout << "Pos: 0x" << std::hex << file.pos() << std::dec << std::endl;
+            NBU_TRACE("S60 compressed files at" << QString::number(cursor.pos(), 16));
             break;
         case 0x1002: // S60 compressed fragments
         case 0x1004: // S60 compressed fragments
         case 0x1006: {// S60 compressed fragments
-            std::cout << "Pos: 0x" << std::hex << file.pos() << std::dec << std::endl;
-            _errors << S_UNSUPPORTED_FOLDER.arg("S60 compressed fragments");
-            while (file.pos()<file.size()) {
-                quint16 x;
-                stream >> x;
+            NBU_TRACE("S60 compressed fragments at" << QString::number(cursor.pos(), 16));
+            QList<NBUCompressedFile> files;
+            while (!cursor.atEnd() && !cursor.failed()) {
+                quint16 x = cursor.getU16();
                 if (x == 0xFFFF)
                 {
                     break; // correct end of folder structure
@@ -489,38 +577,38 @@ std::cout << "tst=0x" << std::hex << tst << std::dec << std::endl;
                     _errors << "Unexpected folder structure";
                     break;
                 }
-                QString fileName = getString16c(stream);
-                std::cout << "fileName: " << fileName.toLocal8Bit().data() << std::endl;
-                if (!fileName.isEmpty()) {
-                    file.seek(file.pos()+12);
-                    stream >> x;
+                NBUCompressedFile compFile;
+                compFile.fileName = cursor.getString16c();
+                NBU_TRACE("fileName:" << compFile.fileName);
+                if (!compFile.fileName.isEmpty()) {
+                    cursor.skip(12);
+                    x = cursor.getU16();
                     if (x == 0)
                     {
                         // empty fragment
-                        file.seek(file.pos()+6);
+                        cursor.skip(6);
                         continue;
                     }
-                    file.seek(file.pos()+18);
+                    cursor.skip(18);
                 }
                 else
                 {
-                    //fileName = "unnamed";
-                    file.seek(file.pos()+8);
+                    compFile.fileName = "unnamed";
+                    cursor.skip(8);
                 }
-                while (true) {
-                    long lenComp = getU32(stream);
-                    long lenUncomp = getU32(stream);
-                    if (file.pos() + lenComp > file.size())
+                while (!cursor.failed()) {
+                    quint32 lenComp = cursor.getU32();
+                    quint32 lenUncomp = cursor.getU32();
+                    if (cursor.pos() + lenComp > cursor.size())
                     {
                         _errors << "Invalid fragment length - out of stream";
                         break;
                     }
-                    // TODO parseCompressedFragment(...
-                    file.seek(file.pos()+lenComp);
+                    compFile.fragments << cursor.getSlice(lenComp);
                     if (lenUncomp < 65536) break;
                     else if (lenUncomp == 65536)
                     {
-                        fileName = "cont";
+                        // next fragment continues this file
                     }
                     else
                     {
@@ -528,7 +616,10 @@ std::cout << "tst=0x" << std::hex << tst << std::dec << std::endl;
                         break;
                     }
                 }
+                if (!compFile.fragments.isEmpty())
+                    files << compFile;
             }
+            inflateFiles(files, list);
             break;
         }
             // TODO other folder types
@@ -538,14 +629,14 @@ std::cout << "tst=0x" << std::hex << tst << std::dec << std::endl;
         }
         if (procAsDefault)
         {
-            int count = getU32(stream);
-            std::cout << "Count=" << count << std::endl;
-            for (int j = 0; j < count; j++)
+            quint32 count = cursor.getU32();
+            NBU_TRACE("Count=" << count);
+            for (quint32 j = 0; j < count && !cursor.failed(); j++)
             {
                 if (tst == 0x1008)
                 {
-                    quint32 x = getU32(stream);
-                    std::cout << "x=" << x << std::endl;
+                    quint32 x = cursor.getU32();
+                    NBU_TRACE("x=" << x);
                     if (x != 0)
                     {
                         if ((x & 0x80000000) == 0x80000000)
@@ -560,163 +651,210 @@ std::cout << "tst=0x" << std::hex << tst << std::dec << std::endl;
                         }
                     }
                 }
-                QString folderName = getString16c(stream);
-                QString fileName = getString16c(stream);
-                file.seek(file.pos()+12);
-                quint32 size = getU32(stream);
-                std::cout << "Folder " << folderName.toLocal8Bit().data()
-                          << " file " << fileName.toLocal8Bit().data()
-                          << " size " << size << std::endl;
-                file.seek(file.pos()+2);
+                QString folderName = cursor.getString16c();
+                QString fileName = cursor.getString16c();
+                cursor.skip(12);
+                quint32 size = cursor.getU32();
+                NBU_TRACE("Folder" << folderName << "file" << fileName << "size" << size);
+                cursor.skip(2);
                 if (folderName.contains("predefmessages")) {
                     BinarySMS sms;
                     sms.name = fileName;
-                    sms.content = file.read(size);
-                    list.extra.binarySMS << sms;
+                    // Deep copy, because mapping is released on file close
+                    QByteArray slice = cursor.getSlice(size);
+                    sms.content = QByteArray(slice.constData(), slice.size());
+                    if (!cursor.failed())
+                        list.extra.binarySMS << sms;
                 }
                 else {
                     // TODO read file here
-                    file.seek(file.pos()+size); //===>
+                    cursor.skip(size); //===>
                 }
             }
-
-
-
-            // TODO
         }
+        return !cursor.failed();
     }
-    return true;
 }
 
-void NBUFile::parseContacts(QDataStream &stream)
+void NBUFile::parseContacts(NBUCursor &cursor)
 {
     // Currently this is a duplicate of vCard record
-    quint32 count = getU32(stream);
-    std::cout << "Folder contacts: " << count << std::endl;
-    for (quint32 j = 0; j < count; j++)
+    quint32 count = cursor.getU32();
+    NBU_TRACE("Folder contacts:" << count);
+    for (quint32 j = 0; j < count && !cursor.failed(); j++)
     {
-        quint8 c3 = getU8(stream); // element count
-        QString s;
-        std::cout << "Contact elems: " << (int)c3 << std::endl;
-        for (quint8 k = 0; k < c3; k++)
+        quint8 c3 = cursor.getU8(); // element count
+        NBU_TRACE("Contact elems:" << (int)c3);
+        for (quint8 k = 0; k < c3 && !cursor.failed(); k++)
         {
-            quint8 x = getU8(stream); // field
-            std::cout << "x: 0x" << std::hex << (int)x << std::dec << std::endl;
+            quint8 x = cursor.getU8(); // field
+            QString s;
             switch (x)
             {
             case 0x0B: // number
-                    stream >> x; // number type
-                    s = this->getString16c(stream);
-                    std::cout << "s: " << s.toLocal8Bit().data() << std::endl;
-                    break;
+                x = cursor.getU8(); // number type
+                s = "number: " + cursor.getString16c();
+                break;
             case 0x1E: // group ???
-            case 0x43: { // group
-                quint32 xx = getU32(stream); // group number
-                std::cout << "G: " << xx << std::endl;
+            case 0x43: // group
+                s = QString("group: %1").arg(cursor.getU32()); // group number
                 break;
-            }
             case 0x57: // ???
-                file.seek(file.pos()+6);
+                cursor.skip(6);
                 break;
             case 0x33: // image
             case 0x37: {// ringtone
-                QString folderName = getString16c(stream);
-                QString fileName = getString16c(stream);
-                file.seek(file.pos()+12);
-                quint32 size = getU32(stream);
-                std::cout << "Folder " << folderName.toLocal8Bit().data()
-                    << " file " << fileName.toLocal8Bit().data()
-                    << " size " << size << std::endl;
-                file.seek(file.pos()+2);
+                QString folderName = cursor.getString16c();
+                QString fileName = cursor.getString16c();
+                cursor.skip(12);
+                quint32 size = cursor.getU32();
+                s = QString("folder %1 file %2 size %3").arg(folderName).arg(fileName).arg(size);
+                cursor.skip(2);
                 // Here we can read image/ringtone
                 // But currently this is a simply duplicate of PHOTO tag
-                file.seek(file.pos()+size);
+                cursor.skip(size);
                 break;
             }
             case 0xFE: { // image link
-                x = getU8(stream); // ??
-                QString link = getString16c(stream); // filename
-                std::cout << "Link " << link.toLocal8Bit().data() << " x " << x << std::endl;
+                x = cursor.getU8(); // ??
+                s = "link: " + cursor.getString16c(); // filename
                 break;
             }
-            case 0x07: s = "name: ";
-                s += this->getString16c(stream);
-                std::cout << s.toLocal8Bit().data() << std::endl;
-                break;
-            case 0x46: s = "first name: ";
-                s += this->getString16c(stream);
-                std::cout << s.toLocal8Bit().data() << std::endl;
-                break;
-            case 0x47: s = "surnames = ";
-                s += this->getString16c(stream);
-                std::cout << s.toLocal8Bit().data() << std::endl;
-                break;
-            case 0x56: s = "nick = ";
-                s += this->getString16c(stream);
-                std::cout << s.toLocal8Bit().data() << std::endl;
-                break;
-            case 0x52: s = "nick = ";
-                s += this->getString16c(stream);
-                std::cout << s.toLocal8Bit().data() << std::endl;
-                break;
-            case 0x08: s = "email = ";
-                s += this->getString16c(stream);
-                std::cout << s.toLocal8Bit().data() << std::endl;
-                break;
-            case 0x0A: s = "note = ";
-                s += this->getString16c(stream);
-                std::cout << s.toLocal8Bit().data() << std::endl;
-                break;
-            case 0x54: s = "position / job = ";
-                s += this->getString16c(stream);
-                std::cout << s.toLocal8Bit().data() << std::endl;
-                break;
-            case 0x55: s = "company = ";
-                s += this->getString16c(stream);
-                std::cout << s.toLocal8Bit().data() << std::endl;
-                break;
-            case 0x4B: s = "address = ";
-                s += this->getString16c(stream);
-                std::cout << s.toLocal8Bit().data() << std::endl;
-                break;
-            case 0x4F: s = "address 2 = ";
-                s += this->getString16c(stream);
-                std::cout << s.toLocal8Bit().data() << std::endl;
-                break;
-            case 0x50: s = "state = ";
-                s += this->getString16c(stream);
-                std::cout << s.toLocal8Bit().data() << std::endl;
-                break;
-            case 0x2C: s = "url = ";
-                s += this->getString16c(stream);
-                std::cout << s.toLocal8Bit().data() << std::endl;
-                break;
-            case 0x09: s = "address 3 = ";
-                s += this->getString16c(stream);
-                std::cout << s.toLocal8Bit().data() << std::endl;
-                break;
-            case 0x4C: s = "address 4 = ";
-                s += this->getString16c(stream);
-                std::cout << s.toLocal8Bit().data() << std::endl;
-                break;
-            case 0x4D: s = "address 5 = ";
-                s += this->getString16c(stream);
-                std::cout << s.toLocal8Bit().data() << std::endl;
-                break;
-            case 0x4E: s = "address 6 = ";
-                s += this->getString16c(stream);
-                std::cout << s.toLocal8Bit().data() << std::endl;
-                break;
-            case 0x3F: s = "X-SIP = ";
-                s += this->getString16c(stream);
-                std::cout << s.toLocal8Bit().data() << std::endl;
-                break;
+            case 0x07: s = "name: " + cursor.getString16c(); break;
+            case 0x46: s = "first name: " + cursor.getString16c(); break;
+            case 0x47: s = "surnames = " + cursor.getString16c(); break;
+            case 0x56: s = "nick = " + cursor.getString16c(); break;
+            case 0x52: s = "nick = " + cursor.getString16c(); break;
+            case 0x08: s = "email = " + cursor.getString16c(); break;
+            case 0x0A: s = "note = " + cursor.getString16c(); break;
+            case 0x54: s = "position / job = " + cursor.getString16c(); break;
+            case 0x55: s = "company = " + cursor.getString16c(); break;
+            case 0x4B: s = "address = " + cursor.getString16c(); break;
+            case 0x4F: s = "address 2 = " + cursor.getString16c(); break;
+            case 0x50: s = "state = " + cursor.getString16c(); break;
+            case 0x2C: s = "url = " + cursor.getString16c(); break;
+            case 0x09: s = "address 3 = " + cursor.getString16c(); break;
+            case 0x4C: s = "address 4 = " + cursor.getString16c(); break;
+            case 0x4D: s = "address 5 = " + cursor.getString16c(); break;
+            case 0x4E: s = "address 6 = " + cursor.getString16c(); break;
+            case 0x3F: s = "X-SIP = " + cursor.getString16c(); break;
             default:
-                s = this->getString16c(stream);
-                std::cout << "UNKNOWN: " << x << "/" << s.toLocal8Bit().data() << std::endl;
+                s = QString("UNKNOWN: %1/").arg((int)x) + cursor.getString16c();
                 break;
             }
+            NBU_TRACE(QString::number(x, 16) << s);
         }
     }
 }
 
+void NBUFile::inflateFiles(const QList<NBUCompressedFile> &files, ContactList &list)
+{
+    // Files are independent, so they are inflated in parallel
+    QThreadPool pool;
+    QList<NBUInflateTask*> tasks;
+    foreach (const NBUCompressedFile& compFile, files) {
+        NBUInflateTask* task = new NBUInflateTask(compFile);
+        tasks << task;
+        pool.start(task);
+    }
+    pool.waitForDone();
+    QStringList content;
+    foreach (NBUInflateTask* task, tasks) {
+        content << task->vCardLines;
+        list.extra.SMS << task->messages;
+        _errors << task->errors;
+        delete task;
+    }
+    if (content.isEmpty())
+        return;
+    int firstItem = list.count();
+    VCardData::importRecords(content, list, true, _errors);
+    for (int i=firstItem; i<list.count(); i++)
+        list[i].originalFormat = "NBU";
+}
+
+NBUInflateTask::NBUInflateTask(const NBUCompressedFile &source)
+    :QRunnable(), _source(source), _searchFrom(0)
+{
+    setAutoDelete(false);
+}
+
+void NBUInflateTask::run()
+{
+    QByteArray window(NBU_INFLATE_WINDOW_SIZE, 0);
+    z_stream zs;
+    zs.zalloc = Z_NULL;
+    zs.zfree = Z_NULL;
+    zs.opaque = Z_NULL;
+    zs.next_in = Z_NULL;
+    zs.avail_in = 0;
+    if (inflateInit(&zs)!=Z_OK) {
+        errors << QObject::tr("Can't decompress %1").arg(_source.fileName);
+        return;
+    }
+    // Each fragment is separate zlib stream; output goes through window
+    // to scanner, so whole file is never held in memory
+    foreach (const QByteArray& fragment, _source.fragments) {
+        inflateReset(&zs);
+        zs.next_in = (Bytef*)fragment.constData();
+        zs.avail_in = fragment.size();
+        int res;
+        do {
+            zs.next_out = (Bytef*)window.data();
+            zs.avail_out = window.size();
+            res = inflate(&zs, Z_NO_FLUSH);
+            if (res==Z_NEED_DICT || res==Z_DATA_ERROR || res==Z_MEM_ERROR) {
+                errors << QObject::tr("Can't decompress %1: %2")
+                    .arg(_source.fileName).arg(zs.msg ? zs.msg : "");
+                break;
+            }
+            scan(window.constData(), window.size()-zs.avail_out);
+        } while (res==Z_OK && zs.avail_out==0);
+    }
+    inflateEnd(&zs);
+}
+
+void NBUInflateTask::scan(const char *data, int size)
+{
+    _carry.append(data, size);
+    forever {
+        if (_recordEnd.isEmpty()) {
+            int vcPos = _carry.indexOf("BEGIN:VCARD");
+            int msgPos = _carry.indexOf("BEGIN:VMSG");
+            if (vcPos==-1 && msgPos==-1) {
+                // Keep tail, that may be start of split marker
+                _carry = _carry.right(QByteArray("BEGIN:VCARD").length()-1);
+                return;
+            }
+            // vCard inside vMessage is part of message
+            bool isMessage = (msgPos!=-1 && (vcPos==-1 || msgPos<vcPos));
+            _carry.remove(0, isMessage ? msgPos : vcPos);
+            _recordEnd = isMessage ? "END:VMSG" : "END:VCARD";
+            _searchFrom = 0;
+        }
+        int endPos = _carry.indexOf(_recordEnd, _searchFrom);
+        if (endPos==-1) {
+            if (_carry.size()>NBU_MAX_EMBEDDED_RECORD_SIZE) {
+                errors << QObject::tr("Unfinished record in %1").arg(_source.fileName);
+                _carry.clear();
+                _recordEnd.clear();
+            }
+            else
+                _searchFrom = qMax(0, _carry.size()-_recordEnd.size()+1);
+            return;
+        }
+        int recLen = endPos+_recordEnd.size();
+        QString record = QString::fromUtf8(_carry.constData(), recLen);
+        if (_recordEnd=="END:VMSG")
+            messages << record;
+        else {
+            QStringList lines = record.split('\n');
+            for (int i=0; i<lines.count(); i++)
+                if (lines[i].endsWith('\r'))
+                    lines[i].chop(1);
+            vCardLines << lines;
+        }
+        _carry.remove(0, recLen);
+        _recordEnd.clear();
+    }
+}
@@ -18,8 +18,10 @@
 #define NBUFILE_H
 
 #include <QtGlobal>
-#include <QDataStream>
+#include <QByteArray>
 #include <QDateTime>
+#include <QList>
+#include <QRunnable>
 #include "fileformat.h"
 #include "../common/vcarddata.h"
 
@@ -32,6 +34,79 @@ struct NBUSectionType
     QString name, name2;
 };
 
+// Bounds-checked little-endian reader over (mapped) NBU file content.
+// Reading past the end gives zero values and sets failed flag; flag is
+// kept until end of cursor life, so each section and folder is read by
+// its own cursor, taken by at()
+class NBUCursor
+{
+public:
+    NBUCursor(const char* data = 0, qint64 size = 0);
+    qint64 pos() const;
+    qint64 size() const;
+    bool failed() const;
+    bool atEnd() const;
+    bool seek(qint64 newPos);
+    // New cursor over same content, not failed, if newPos is valid
+    NBUCursor at(qint64 newPos) const;
+    bool skip(qint64 count);
+    quint8 getU8();
+    quint16 getU16();
+    quint32 getU32();
+    quint64 getU64();
+    QString getString16c();
+    QString getString16(qint64 byteLen);
+    QDateTime getDateTime();
+    // Zero-copy; valid while file content is mapped
+    QByteArray getSlice(qint64 len);
+private:
+    const uchar* _data;
+    qint64 _size;
+    qint64 _pos;
+    bool _failed;
+    bool ensure(qint64 count);
+};
+
+// Section table record, collected before any section content is decoded
+struct NBUSectionIndex
+{
+    NBUSectionType* type;
+    quint32 number;
+    quint64 start;
+    quint32 count; // section-specific counter (folders, groups...)
+    QList<quint64> folders;
+};
+
+// Chain of zlib-compressed S60 fragments, forming one file inside backup
+struct NBUCompressedFile
+{
+    QString fileName;
+    QList<QByteArray> fragments; // zero-copy slices of mapped file
+};
+
+// Output window for fragment decompression
+#define NBU_INFLATE_WINDOW_SIZE 65536
+// Larger unfinished record is treated as garbage
+#define NBU_MAX_EMBEDDED_RECORD_SIZE 1048576
+
+// Inflates one compressed file in worker thread through fixed-size
+// window and picks vCards and vMessages embedded into its content
+class NBUInflateTask : public QRunnable
+{
+public:
+    NBUInflateTask(const NBUCompressedFile& source);
+    void run();
+    QStringList vCardLines;
+    QStringList messages;
+    QStringList errors;
+private:
+    NBUCompressedFile _source;
+    QByteArray _carry; // unfinished record (or possible marker start)
+    QByteArray _recordEnd; // empty if outside record
+    int _searchFrom;
+    void scan(const char* data, int size);
+};
+
 class NBUFile : public FileFormat, VCardData
 {
 public:
@@ -40,20 +115,20 @@ public:
     // IFormat interface
 public:
     static bool detect(const QString &url);
+    static int detectScore(const FileHeader& header);
     static QStringList supportedExtensions();
     static QStringList supportedFilters();
     bool importRecords(const QString &url, ContactList &list, bool append);
     bool exportRecords(const QString &, ContactList &);
 private:
-    static QDateTime getDateTime(QDataStream& stream);
-    static QString getString16c(QDataStream& stream);
-    static quint64 getU64(QDataStream& stream);
-    static quint32 getU32(QDataStream& stream);
-    static quint8 getU8(QDataStream& stream);
-    NBUSectionType* findSectionType(quint8* sectID);
-    bool parseFolderVcard(QDataStream& stream, ContactList &list, const QString& sectName);
-    bool parseFolder(QDataStream& stream, long start, const QString& sectName, ContactList &list);
-    void parseContacts (QDataStream &stream);
+    NBUSectionType* findSectionType(const quint8* sectID);
+    bool readSectionIndex(NBUCursor& cursor, QList<NBUSectionIndex>& sections);
+    bool parseFolderVcard(NBUCursor& cursor, ContactList &list, const QString& sectName);
+    void parseGroups(const NBUCursor& content, const NBUSectionIndex& section, ContactList &list, int firstContact);
+    void parseGeneralSection(const NBUCursor& content, const NBUSectionIndex& section, ContactList &list);
+    bool parseFolder(const NBUCursor& content, quint64 start, const QString& sectName, ContactList &list);
+    void parseContacts(NBUCursor& cursor);
+    void inflateFiles(const QList<NBUCompressedFile>& files, ContactList &list);
 };
 
 #endif // NBUFILE_H
@@ -11,32 +11,28 @@
  *
  */
 
+#include <QHash>
 #include <QTextCodec>
-#include <QTextStream>
 #include <QSet>
 #include "../common/quotedprintable.h"
 #include "udxfile.h"
 
 UDXFile::UDXFile()
-    :FileFormat(), QDomDocument("DataExchangeInfo")
+    :FileFormat(), expCount(0)
 {
 }
 
 bool UDXFile::detect(const QString &url)
 {
-    QFile file(url);
-    // - file is readable
-    if (!file.open( QIODevice::ReadOnly))
-        return false;
-    // - file is XML
-    QDomDocument udx;
-    if (!udx.setContent(&file)) {
-        file.close();
-        return false;
-    }
-    file.close();
-    // - root file tag must be...
-    return udx.documentElement().nodeName()=="DataExchangeInfo";
+    return detectScore(FileHeader(url))!=NotDetected;
+}
+
+int UDXFile::detectScore(const FileHeader &header)
+{
+    // File is XML and root file tag must be...
+    QXmlStreamReader xml(header.raw);
+    return (xml.readNextStartElement() && xml.name()==QLatin1String("DataExchangeInfo"))
+        ? SureDetected : NotDetected;
 }
 
 QStringList UDXFile::supportedExtensions()
@@ -53,115 +49,66 @@ bool UDXFile::importRecords(const QString &url, ContactList &list, bool append)
 {
     if (!openFile(url, QIODevice::ReadOnly))
         return false;
-    // Read XML
-    QString err_msg;
-    int err_line, err_col;
-    if (!setContent(&file, &err_msg, &err_line, &err_col)) {
-        _errors << QObject::tr("Can't read content from file %1\n%2\nline %3, col %4\n")
-            .arg(url).arg(err_msg).arg(err_line).arg(err_col);
+    QXmlStreamReader xml(&file);
+    // Root element
+    if (!xml.readNextStartElement() || xml.name()!=QLatin1String("DataExchangeInfo")) {
+        _errors << QObject::tr("Root node is not 'DataExchangeInfo' at file\n%1").arg(url);
         closeFile();
         return false;
     }
+    // Records read to separate list, because list must be unchanged on fatal error
+    ContactList records;
+    bool hasRecInfo = false;
+    bool hasVCard = false;
+    QTextCodec* codec = 0;
+    while (xml.readNextStartElement()) {
+        if (xml.name()==QLatin1String("RecordInfo")) {
+            // Codepage, version, expected record count
+            hasRecInfo = true;
+            readRecordInfo(xml);
+            codec = QTextCodec::codecForName(charSet.toLocal8Bit());
+        }
+        else if (xml.name()==QLatin1String("vCard")) {
+            if (!hasRecInfo) {
+                _errors << QObject::tr("Can't find 'RecordInfo' tag at file\n%1").arg(url);
+                closeFile();
+                return false;
+            }
+            // vCard set
+            hasVCard = true;
+            while (xml.readNextStartElement()) {
+                if (xml.name()==QLatin1String("vCardInfo")) {
+                    ContactItem item;
+                    readVCardInfo(xml, codec, item);
+                    records.appendSwapped(item);
+                }
+                else
+                    xml.skipCurrentElement();
+            }
+        }
+        else
+            xml.skipCurrentElement();
+    }
     closeFile();
-    // Root element
-    QDomElement root = documentElement();
-    if (root.nodeName()!="DataExchangeInfo") {
-        _errors << QObject::tr("Root node is not 'DataExchangeInfo' at file\n%1").arg(url);
+    if (xml.hasError()) {
+        _errors << QObject::tr("Can't read content from file %1\n%2\nline %3, col %4\n")
+            .arg(url).arg(xml.errorString()).arg(xml.lineNumber()).arg(xml.columnNumber());
         return false;
     }
-    // Codepage, version, expected record count
-    QDomElement recInfo = root.firstChildElement("RecordInfo");
-    if (recInfo.isNull()) {
+    if (!hasRecInfo) {
         _errors << QObject::tr("Can't find 'RecordInfo' tag at file\n%1").arg(url);
         return false;
     }
-    QString charSet = recInfo.firstChildElement("Encoding").text();
-    if (charSet.isEmpty()) {
-        _errors << QObject::tr("Warning: codepage not found, trying use UTF-8...");
-        charSet = "UTF-8";
-    }
-    QString udxVer = recInfo.firstChildElement("UdxVersion").text();
-    if (udxVer.isEmpty()) {
-        _errors << QObject::tr("Warning: udx version not found, treat as 1.0...");
-        udxVer = "1.0";
-    }
-    QDomElement vcfInfo = recInfo.firstChildElement("RecordOfvCard");
-    QString vcVer = vcfInfo.firstChildElement("vCardVersion").text();
-    int expCount = vcfInfo.firstChildElement("vCardRecord").text().toInt();
-    // vCard set
-    QDomElement vCard = root.firstChildElement("vCard");
-    if (vCard.isNull()) {
+    if (!hasVCard) {
         _errors << QObject::tr("Can't find 'vCard' records at file\n%1").arg(url);
         return false;
     }
-    QTextCodec* codec = QTextCodec::codecForName(charSet.toLocal8Bit());
-    ContactItem item;
+    if (records.count()!=expCount)
+        _errors << QObject::tr("%1 records read, %2 expected").arg(records.count()).arg(expCount);
     if (!append)
         list.clear();
-    QDomElement vCardInfo = vCard.firstChildElement("vCardInfo");
-    while (!vCardInfo.isNull()) {
-        item.clear();
-        item.originalFormat = "UDX";
-        item.version = udxVer;
-        item.subVersion = vcVer;
-        item.id = vCardInfo.firstChildElement("Sequence").text();
-        item.idType = "Sequence"; // not UID, simple number
-        QDomElement fields = vCardInfo.firstChildElement("vCardField");
-        if (fields.isNull())
-            _errors << QObject::tr("Can't find 'vCardField' at sequence %1").arg(item.id);
-        QDomElement field = fields.firstChildElement();
-        while (!field.isNull()) {
-            QString fldName = field.nodeName().toUpper();
-            QString fldValue = field.text(); // codec->toUnicode(field.text().toLocal8Bit()); TODO not works on windows
-            if (fldValue.contains("=")) { // quoted-printable
-                QuotedPrintable::mergeLines(fldValue);
-                fldValue = QuotedPrintable::decode(fldValue, codec);
-            }
-            if (fldName=="N") {
-                fldValue.replace("\\;", " ");
-                // In ALL known me udx files part before first ; was EMPTY
-                fldValue.remove(";");
-                item.names = fldValue.split(" ");
-                // If empty parts not in-middle, remove it
-                item.dropFinalEmptyNames();
-            }
-            else if (fldName.startsWith("TEL")) {
-                Phone phone;
-                phone.value = fldValue;
-                if (fldName=="TEL")
-                    phone.types << "CELL";
-                else if (fldName=="TELHOME")
-                    phone.types << "HOME";
-                else if (fldName=="TELWORK")
-                    phone.types << "WORK";
-                else if (fldName=="TELFAX")
-                    phone.types << "FAX";
-                else
-                    _errors << QObject::tr("Unknown phone type: %1 (%2)").arg(phone.value).arg(item.names[0]);
-                phone.syncMLRef = -1;
-                item.phones.push_back(phone);
-            }
-            else if (fldName=="ORGNAME")
-                item.organization = fldValue;
-            else if (fldName=="BDAY")
-                item.birthday.value = QDateTime::fromString(fldValue, "yyyyMMdd"); // TODO Maybe, use DateItem::fromString
-            else if (fldName=="EMAIL") {
-                Email email;
-                email.value = fldValue;
-                email.types << "pref";
-                email.syncMLRef = -1;
-                item.emails.push_back(email);
-            }
-            else
-                _errors << QObject::tr("Unknown 'vCardfield' type: %1").arg(fldName);
-            field = field.nextSiblingElement();
-        }
-        item.calculateFields();
-        list.push_back(item);
-        vCardInfo = vCardInfo.nextSiblingElement();
-    }
-    if (list.count()!=expCount)
-        _errors << QObject::tr("%1 records read, %2 expected").arg(list.count()).arg(expCount);
+    for (int i=0; i<records.count(); i++)
+        list.appendSwapped(records[i]);
     // Unknown tags statistics
     int totalUnknownTags = 0;
     foreach (const ContactItem& _item, list)
@@ -172,46 +119,114 @@ bool UDXFile::importRecords(const QString &url, ContactList &list, bool append)
     return (!list.isEmpty());
 }
 
+void UDXFile::readRecordInfo(QXmlStreamReader &xml)
+{
+    charSet.clear();
+    udxVer.clear();
+    vcVer.clear();
+    expCount = 0;
+    while (xml.readNextStartElement()) {
+        if (xml.name()==QLatin1String("Encoding"))
+            charSet = xml.readElementText();
+        else if (xml.name()==QLatin1String("UdxVersion"))
+            udxVer = xml.readElementText();
+        else if (xml.name()==QLatin1String("RecordOfvCard")) {
+            while (xml.readNextStartElement()) {
+                if (xml.name()==QLatin1String("vCardVersion"))
+                    vcVer = xml.readElementText();
+                else if (xml.name()==QLatin1String("vCardRecord"))
+                    expCount = xml.readElementText().toInt();
+                else
+                    xml.skipCurrentElement();
+            }
+        }
+        else
+            xml.skipCurrentElement();
+    }
+    if (charSet.isEmpty()) {
+        _errors << QObject::tr("Warning: codepage not found, trying use UTF-8...");
+        charSet = "UTF-8";
+    }
+    if (udxVer.isEmpty()) {
+        _errors << QObject::tr("Warning: udx version not found, treat as 1.0...");
+        udxVer = "1.0";
+    }
+}
+
+void UDXFile::readVCardInfo(QXmlStreamReader &xml, QTextCodec *codec, ContactItem &item)
+{
+    item.clear();
+    item.originalFormat = "UDX";
+    item.version = udxVer;
+    item.subVersion = vcVer;
+    item.idType = "Sequence"; // not UID, simple number
+    bool hasFields = false;
+    while (xml.readNextStartElement()) {
+        if (xml.name()==QLatin1String("Sequence"))
+            item.id = xml.readElementText();
+        else if (xml.name()==QLatin1String("vCardField")) {
+            hasFields = true;
+            while (xml.readNextStartElement()) {
+                QString fldName = xml.name().toString().toUpper();
+                QString fldValue = xml.readElementText(); // codec->toUnicode(field.text().toLocal8Bit()); TODO not works on windows
+                if (fldValue.contains("=")) { // quoted-printable
+                    QuotedPrintable::mergeLines(fldValue);
+                    fldValue = QuotedPrintable::decode(fldValue, codec);
+                }
+                if (fldName=="N") {
+                    fldValue.replace("\\;", " ");
+                    // In ALL known me udx files part before first ; was EMPTY
+                    fldValue.remove(";");
+                    item.names = fldValue.split(" ");
+                    // If empty parts not in-middle, remove it
+                    item.dropFinalEmptyNames();
+                }
+                else if (fldName.startsWith("TEL")) {
+                    Phone phone;
+                    phone.value = fldValue;
+                    if (fldName=="TEL")
+                        phone.types << "CELL";
+                    else if (fldName=="TELHOME")
+                        phone.types << "HOME";
+                    else if (fldName=="TELWORK")
+                        phone.types << "WORK";
+                    else if (fldName=="TELFAX")
+                        phone.types << "FAX";
+                    else
+                        _errors << QObject::tr("Unknown phone type: %1 (%2)").arg(phone.value).arg(item.names[0]);
+                    phone.syncMLRef = -1;
+                    item.phones.push_back(phone);
+                }
+                else if (fldName=="ORGNAME")
+                    item.organization = fldValue;
+                else if (fldName=="BDAY")
+                    item.birthday.value = QDateTime::fromString(fldValue, "yyyyMMdd"); // TODO Maybe, use DateItem::fromString
+                else if (fldName=="EMAIL") {
+                    Email email;
+                    email.value = fldValue;
+                    email.types << "pref";
+                    email.syncMLRef = -1;
+                    item.emails.push_back(email);
+                }
+                else
+                    _errors << QObject::tr("Unknown 'vCardfield' type: %1").arg(fldName);
+            }
+        }
+        else
+            xml.skipCurrentElement();
+    }
+    if (!hasFields)
+        _errors << QObject::tr("Can't find 'vCardField' at sequence %1").arg(item.id);
+    item.calculateFields();
+}
+
 bool UDXFile::exportRecords(const QString &url, ContactList &list)
 {
-    QDomDocument::clear();
-    QDomElement root = createElement("DataExchangeInfo");
-    appendChild(root);
     // Original format also was UDX?
     bool wasUDX = false;
     if (!list.isEmpty())
         if (list[0].originalFormat=="UDX")
             wasUDX = true;
-    // XML header
-    QDomNode node = createProcessingInstruction("xml", "version=\"1.0\" encoding=\"utf-8\"");
-    insertBefore(node, firstChild());
-    // UDX header
-    QDomElement recInfo = addElement(root, "RecordInfo");
-    addElement(recInfo, "VendorInfo", "VendorUDX");
-    addElement(recInfo, "DeviceInfo", "DeviceUDX");
-    if (wasUDX)
-        addElement(recInfo, "UdxVersion", list[0].version);
-    else
-        addElement(recInfo, "UdxVersion", "1.0");
-    addElement(recInfo, "UserAgent", "AgentUDX");
-    addElement(recInfo, "UserInfo", "UserUDX");
-    addElement(recInfo, "Encoding", "UTF-8");
-    addElement(recInfo, "FileSize", "          "); // strongly 10 spaces! (~~)
-    addElement(recInfo, "Date", QDate::currentDate().toString("dd.MM.yyyy"));
-    addElement(recInfo, "Language","CHS"); // wtf, but this code was in real russian-language udx
-    QDomElement vcfInfo = addElement(recInfo, "RecordOfvCard");
-    if (wasUDX)
-        addElement(vcfInfo, "vCardVersion", list[0].subVersion);
-    else
-        addElement(vcfInfo, "vCardVersion", "2.1");
-    addElement(vcfInfo, "vCardRecord", QString::number(list.count()));
-    addElement(vcfInfo, "vCardLength", "          "); // strongly 10 spaces! (~~)
-    addElement(recInfo, "RecordOfvCalendar");
-    addElement(recInfo, "RecordOfSMS");
-    addElement(recInfo, "RecordOfMMS");
-    addElement(recInfo, "RecordOfEmail");
-    // Parent tag for all records
-    QDomElement vCard = addElement(root, "vCard");
     // Add missing sequences to records
     int maxSeq = 0;
     if (wasUDX) { // wasUDX - simply add missing
@@ -237,91 +252,181 @@ bool UDXFile::exportRecords(const QString &url, ContactList &list)
             list[i].id = QString::number(i+1);
         maxSeq = list.count();
     }
+    // Record indexes by sequence (first one, as in ContactList::findById)
+    QHash<int, int> indexBySeq;
+    for (int i=0; i<list.count(); i++) {
+        int seq = list[i].id.toInt();
+        if (!indexBySeq.contains(seq))
+            indexBySeq.insert(seq, i);
+    }
+    // Sizes are unknown until end, so file will be read back to write them
+    if (!openFile(url, QIODevice::ReadWrite | QIODevice::Truncate))
+        return false;
+    QXmlStreamWriter xml(&file);
+    xml.setCodec("UTF-8");
+    // XML header must be at first byte, so formatting is switched on after it
+    xml.writeProcessingInstruction("xml", "version=\"1.0\" encoding=\"utf-8\"");
+    xml.setAutoFormatting(true);
+    xml.setAutoFormattingIndent(0);
+    xml.writeDTD("<!DOCTYPE DataExchangeInfo>");
+    xml.writeStartElement("DataExchangeInfo");
+    // UDX header
+    xml.writeStartElement("RecordInfo");
+    addElement(xml, "VendorInfo", "VendorUDX");
+    addElement(xml, "DeviceInfo", "DeviceUDX");
+    if (wasUDX)
+        addElement(xml, "UdxVersion", list[0].version);
+    else
+        addElement(xml, "UdxVersion", "1.0");
+    addElement(xml, "UserAgent", "AgentUDX");
+    addElement(xml, "UserInfo", "UserUDX");
+    addElement(xml, "Encoding", "UTF-8");
+    addElement(xml, "FileSize", "          "); // strongly 10 spaces! (~~)
+    addElement(xml, "Date", QDate::currentDate().toString("dd.MM.yyyy"));
+    addElement(xml, "Language","CHS"); // wtf, but this code was in real russian-language udx
+    xml.writeStartElement("RecordOfvCard");
+    if (wasUDX)
+        addElement(xml, "vCardVersion", list[0].subVersion);
+    else
+        addElement(xml, "vCardVersion", "2.1");
+    addElement(xml, "vCardRecord", QString::number(list.count()));
+    addElement(xml, "vCardLength", "          "); // strongly 10 spaces! (~~)
+    xml.writeEndElement(); // RecordOfvCard
+    addElement(xml, "RecordOfvCalendar");
+    addElement(xml, "RecordOfSMS");
+    addElement(xml, "RecordOfMMS");
+    addElement(xml, "RecordOfEmail");
+    xml.writeEndElement(); // RecordInfo
+    // Parent tag for all records
+    xml.writeStartElement("vCard");
     // Write all records, sorted by id
     for(int i=1; i<=maxSeq; i++) {
-        int index = list.findById(QString::number(i));
+        int index = indexBySeq.value(i, -1);
         if (index==-1)
             continue;
-        ContactItem& item = list[index];
-        QDomElement vCardInfo = addElement(vCard, "vCardInfo");
-        addElement(vCardInfo, "Sequence", item.id);
-        QDomElement vCardField = addElement(vCardInfo, "vCardField");
-        // Names
-        addElement(vCardField, "N", QString(";")+item.names.join(" ")); // sad but true
-        // Phones
-        foreach (const Phone& ph, item.phones) {
-            if (ph.types.contains("CELL", Qt::CaseInsensitive))
-                addElement(vCardField, "TEL", ph.value);
-            else if (ph.types.contains("HOME", Qt::CaseInsensitive))
-                addElement(vCardField, "TELHOME", ph.value);
-            else if (ph.types.contains("WORK", Qt::CaseInsensitive))
-                addElement(vCardField, "TELWORK", ph.value);
-            else if (ph.types.contains("FAX", Qt::CaseInsensitive))
-                addElement(vCardField, "TELFAX", ph.value);
-            else if (ph.types.join(";").toUpper()!="PREF") {
-                addElement(vCardField, "TEL", ph.value);
-                _errors << QObject::tr("Warning: contact %1, unknown tel type:\n%2\n saved as cellular")
-                     .arg(item.visibleName).arg(ph.types.join(";"));
-            }
-        }
-        // Emails
-        foreach (const Email& em, item.emails)
-            addElement(vCardField, "EMAIL", em.value);
-        // TODO what if save some EMAIL tags? (also some one-type TEL)
-        // Organization/title
-        if (!item.organization.isEmpty()) {
-            QString org = item.organization;
-            if (!item.title.isEmpty())
-                org += ", " + item.title;
-            addElement(vCardField, "ORGNAME", org);
+        writeRecord(xml, list[index]);
+    }
+    xml.writeEndElement(); // vCard
+    xml.writeEndDocument();
+    bool res = (file.error()==QFile::NoError) && writeSizes();
+    if (!res)
+        _fatalError = S_WRITE_ERR.arg(url);
+    closeFile();
+    return res;
+}
+
+void UDXFile::writeRecord(QXmlStreamWriter &xml, const ContactItem &item)
+{
+    xml.writeStartElement("vCardInfo");
+    addElement(xml, "Sequence", item.id);
+    xml.writeStartElement("vCardField");
+    // Names
+    addElement(xml, "N", QString(";")+item.names.join(" ")); // sad but true
+    // Phones
+    foreach (const Phone& ph, item.phones) {
+        if (ph.types.contains("CELL", Qt::CaseInsensitive))
+            addElement(xml, "TEL", ph.value);
+        else if (ph.types.contains("HOME", Qt::CaseInsensitive))
+            addElement(xml, "TELHOME", ph.value);
+        else if (ph.types.contains("WORK", Qt::CaseInsensitive))
+            addElement(xml, "TELWORK", ph.value);
+        else if (ph.types.contains("FAX", Qt::CaseInsensitive))
+            addElement(xml, "TELFAX", ph.value);
+        else if (ph.types.join(";").toUpper()!="PREF") {
+            addElement(xml, "TEL", ph.value);
+            _errors << QObject::tr("Warning: contact %1, unknown tel type:\n%2\n saved as cellular")
+                 .arg(item.visibleName).arg(ph.types.join(";"));
         }
-        // Birthday
-        if (item.birthday.value.isValid())
-            addElement(vCardField, "BDAY", item.birthday.toString(DateItem::ISOBasic));
-        // TODO maybe some phones support time in udx? need search specs, and maybe need use DateItem::toString() here
-        // but check format, - and T, maybe it's vCard 2.1
-        if (item.birthday.hasTime)
-            _errors << QObject::tr("Warning: contact %1 has time (%2) in birthday, not implemented in UDX reader")
-                 .arg(item.visibleName).arg(item.birthday.value.toString("hh:mm:ss"));
-        if (!item.addrs.isEmpty())
-            _errors << QObject::tr("Warning: contact %1 has address(es), not implemented in UDX")
-                 .arg(item.visibleName);
-        if (!item.photo.isEmpty())
-            _errors << QObject::tr("Warning: contact %1 has photo, not implemented in UDX").arg(item.visibleName);
-        if (!item.description.isEmpty())
-            _errors << QObject::tr("Warning: contact %1 has description, not implemented in UDX").arg(item.visibleName);
+    }
+    // Emails
+    foreach (const Email& em, item.emails)
+        addElement(xml, "EMAIL", em.value);
+    // TODO what if save some EMAIL tags? (also some one-type TEL)
+    // Organization/title
+    if (!item.organization.isEmpty()) {
+        QString org = item.organization;
         if (!item.title.isEmpty())
-            _errors << QObject::tr("Warning: contact %1 has job title, not implemented in UDX").arg(item.visibleName);
-        if (!item.anniversary.isEmpty())
-            _errors << QObject::tr("Warning: contact %1 has anniversaries, not implemented in UDX").arg(item.visibleName);
-        // Here place warning on all other udx-unsupported things
+            org += ", " + item.title;
+        addElement(xml, "ORGNAME", org);
     }
-    QString content = toString(0);
-    // Add left-aligned file size, completed to 10 characters
-    int fsPos = content.indexOf("<FileSize>")+QString("<FileSize>").length();
-    int fileSize = content.toLocal8Bit().size();
-    content.replace(fsPos, 10, QString("%1").arg(fileSize, -10, 10, QChar(' ')));
-    // Add left-aligned vcard length, completed to 10 characters
-    int vclPos = content.indexOf("<vCardLength>")+QString("<vCardLength>").length();
-    int vcLength = content.indexOf("</vCard>")-content.indexOf("<vCard>")+QString("</vCard>").length();
-    content.replace(vclPos, 10, QString("%1").arg(vcLength, -10, 10, QChar(' ')));
-    // Write to file
-    if (!openFile(url, QIODevice::WriteOnly))
-        return false;
-    QTextStream stream(&file);
-    stream.setCodec("UTF-8");
-    stream << content;
-    closeFile();
-    return true;
+    // Birthday
+    if (item.birthday.value.isValid())
+        addElement(xml, "BDAY", item.birthday.toString(DateItem::ISOBasic));
+    xml.writeEndElement(); // vCardField
+    xml.writeEndElement(); // vCardInfo
+    // TODO maybe some phones support time in udx? need search specs, and maybe need use DateItem::toString() here
+    // but check format, - and T, maybe it's vCard 2.1
+    if (item.birthday.hasTime)
+        _errors << QObject::tr("Warning: contact %1 has time (%2) in birthday, not implemented in UDX reader")
+             .arg(item.visibleName).arg(item.birthday.value.toString("hh:mm:ss"));
+    if (!item.addrs.isEmpty())
+        _errors << QObject::tr("Warning: contact %1 has address(es), not implemented in UDX")
+             .arg(item.visibleName);
+    if (!item.photo.isEmpty())
+        _errors << QObject::tr("Warning: contact %1 has photo, not implemented in UDX").arg(item.visibleName);
+    if (!item.description.isEmpty())
+        _errors << QObject::tr("Warning: contact %1 has description, not implemented in UDX").arg(item.visibleName);
+    if (!item.title.isEmpty())
+        _errors << QObject::tr("Warning: contact %1 has job title, not implemented in UDX").arg(item.visibleName);
+    if (!item.anniversary.isEmpty())
+        _errors << QObject::tr("Warning: contact %1 has anniversaries, not implemented in UDX").arg(item.visibleName);
+    // Here place warning on all other udx-unsupported things
+}
+
+void UDXFile::addElement(QXmlStreamWriter &xml, const QString &tagName, const QString &tagValue)
+{
+    if (tagValue.isEmpty())
+        xml.writeEmptyElement(tagName);
+    else
+        xml.writeTextElement(tagName, tagValue);
 }
 
-QDomElement UDXFile::addElement(QDomElement &parent, const QString &tagName, const QString &tagValue)
+bool UDXFile::writeSizes()
 {
-    QDomElement e = createElement(tagName);
-    if (!tagValue.isEmpty()) {
-        QDomText t = createTextNode(tagValue);
-        e.appendChild(t);
+    if (!file.flush())
+        return false;
+    qint64 fileSize = file.size();
+    // Placeholders and vCard section start are in short header
+    if (!file.seek(0))
+        return false;
+    QByteArray header = file.read(UDX_HEADER_MAX_SIZE);
+    int fsPos = header.indexOf("<FileSize>");
+    int vclPos = header.indexOf("<vCardLength>");
+    if (fsPos==-1 || vclPos==-1)
+        return false;
+    fsPos += QString("<FileSize>").length();
+    vclPos += QString("<vCardLength>").length();
+    // Add left-aligned vcard length (in characters, from <vCard> to </vCard>)
+    qint64 vcLength = 0;
+    int vcStart = header.indexOf("<vCard>");
+    if (vcStart==-1) // empty list
+        vcLength = QString("<vCard/>").length();
+    else {
+        qint64 tailPos = qMax(qint64(0), fileSize-256);
+        file.seek(tailPos);
+        QByteArray tail = file.readAll();
+        int vcEndInTail = tail.lastIndexOf("</vCard>");
+        if (vcEndInTail==-1)
+            return false;
+        qint64 left = tailPos+vcEndInTail+QString("</vCard>").length()-vcStart;
+        file.seek(vcStart);
+        while (left>0) {
+            QByteArray block = file.read(qMin(left, qint64(65536)));
+            if (block.isEmpty())
+                return false;
+            left -= block.size();
+            // Count UTF-8 lead bytes; 4-byte sequences are surrogate pairs in QString
+            for (int i=0; i<block.size(); i++) {
+                uchar b = (uchar)block[i];
+                if ((b & 0xC0)!=0x80)
+                    vcLength += (b>=0xF0) ? 2 : 1;
+            }
+        }
     }
-    parent.appendChild(e);
-    return e;
+    // Add left-aligned file size, completed to 10 characters
+    file.seek(fsPos);
+    file.write(QString("%1").arg(fileSize, -10, 10, QChar(' ')).toLatin1());
+    file.seek(vclPos);
+    file.write(QString("%1").arg(vcLength, -10, 10, QChar(' ')).toLatin1());
+    return (file.error()==QFile::NoError);
 }
@@ -14,22 +14,35 @@
 #ifndef UDXFILE_H
 #define UDXFILE_H
 
-
-#include <QDomDocument>
+#include <QTextCodec>
+#include <QXmlStreamReader>
+#include <QXmlStreamWriter>
 #include "fileformat.h"
 
-class UDXFile : public FileFormat, QDomDocument
+// Maximum size of UDX header before first record
+#define UDX_HEADER_MAX_SIZE 4096
+
+// Records are read and written one by one with XML stream classes,
+// without document tree for whole file
+class UDXFile : public FileFormat
 {
 public:
     UDXFile();
     // IFormat interface
     static bool detect(const QString &url);
+    static int detectScore(const FileHeader& header);
     static QStringList supportedExtensions();
     static QStringList supportedFilters();
     bool importRecords(const QString &url, ContactList &list, bool append);
     bool exportRecords(const QString &url, ContactList &list);
 private:
-    QDomElement addElement(QDomElement& parent, const QString& tagName, const QString& tagValue = "");
+    QString charSet, udxVer, vcVer;
+    int expCount;
+    void readRecordInfo(QXmlStreamReader& xml);
+    void readVCardInfo(QXmlStreamReader& xml, QTextCodec* codec, ContactItem& item);
+    void writeRecord(QXmlStreamWriter& xml, const ContactItem& item);
+    void addElement(QXmlStreamWriter& xml, const QString& tagName, const QString& tagValue = "");
+    bool writeSizes();
 };
 
 #endif // UDXFILE_H
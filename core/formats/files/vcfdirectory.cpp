@@ -11,12 +11,23 @@
  *
  */
 #include "vcfdirectory.h"
+#include <QCryptographicHash>
+#include <QDataStream>
 #include <QDir>
+#include <QFileInfo>
+#if QT_VERSION >= 0x050100
+#include <QSaveFile>
+#endif
+#include <QSet>
 #include <QStringList>
+#include <QTextCodec>
 #include <QTextStream>
+#include <QThread>
+#include <QThreadPool>
 
 #include "globals.h"
 #include "../common/vcarddata.h"
+#include "../network/asyncformat.h"
 
 VCFDirectory::VCFDirectory()
     :FileFormat()
@@ -35,58 +46,386 @@ bool VCFDirectory::importRecords(const QString &url, ContactList &list, bool app
         _fatalError =  QObject::tr("Directory not exists:\n%1").arg(url);
         return false;
     }
-    QStringList entries = d.entryList(QStringList("*.vcf"), QDir::Files, QDir::Name | QDir::IgnoreCase);
-    if (entries.isEmpty()) {
+    QFileInfoList fileInfos = d.entryInfoList(QStringList("*.vcf"), QDir::Files, QDir::Name | QDir::IgnoreCase);
+    if (fileInfos.isEmpty()) {
         _fatalError =  QObject::tr("Directory not contains VCF files:\n%1").arg(url);
         return false;
     }
-    VCardData data;
     _errors.clear();
-    foreach (const QString& fileName, entries) {
-        if (!openFile(url + QDir::separator() + fileName, QIODevice::ReadOnly))
-            return false;
+    // Files with same size and time are taken from manifest without reading;
+    // deleted files are simply not used
+    QHash<QString, VCFDirEntry*> oldEntries;
+    loadManifest(url, oldEntries);
+    bool manifestChanged = (oldEntries.count()!=fileInfos.count());
+    QList<VCFDirEntry*> entries;
+    QList<VCFDirEntry*> changedEntries;
+    foreach (const QFileInfo& info, fileInfos) {
+        VCFDirEntry* entry = oldEntries.take(info.fileName());
+        if (!entry) {
+            entry = new VCFDirEntry;
+            entry->fileName = info.fileName();
+        }
+        if (!entry->cached || entry->size!=info.size() || entry->modified!=info.lastModified()) {
+            entry->size = info.size();
+            entry->modified = info.lastModified();
+            changedEntries << entry;
+        }
+        entries << entry;
+    }
+    qDeleteAll(oldEntries);
+    // Changed files are read and parsed in batches
+    bool parallel = QThread::idealThreadCount()>1 && !gd.debugSave; // load log isn't thread-safe
+    QThreadPool pool;
+    QList<VCFDirImportTask*> tasks;
+    for (int i=0; i<changedEntries.count(); i+=VCF_DIR_BATCH_SIZE) {
+        VCFDirImportTask* task = new VCFDirImportTask(url);
+        task->entries = changedEntries.mid(i, VCF_DIR_BATCH_SIZE);
+        tasks << task;
+        if (parallel)
+            pool.start(task);
+        else
+            task->run();
+    }
+    pool.waitForDone();
+    QString fatalError;
+    foreach (VCFDirImportTask* task, tasks) {
+        if (fatalError.isEmpty())
+            fatalError = task->fatalError;
+        delete task;
+    }
+    bool res = fatalError.isEmpty();
+    if (!res)
+        _fatalError = fatalError;
+    else {
+        if (manifestChanged || !changedEntries.isEmpty())
+            saveManifest(url, entries);
+        // Contacts of one directory can be saved back incrementally;
+        // mixed sources can't. Source file of append-only format (NBF) is kept
+        if (list.isEmpty())
+            list.originalPath = url;
+        else if (list.originalPath!=url && !QFileInfo(list.originalPath).isFile())
+            list.originalPath.clear();
+        // Merge keeps sorted-name order
+        foreach (VCFDirEntry* entry, entries) {
+            for (int i=0; i<entry->items.count(); i++) {
+                entry->items[i].fileName = entry->fileName;
+                list.appendSwapped(entry->items[i]);
+            }
+            _errors << entry->errors;
+        }
+    }
+    qDeleteAll(entries);
+    return res;
+}
+
+bool VCFDirectory::exportRecords(const QString &url, ContactList &list)
+{
+    QDir d;
+    if (!d.mkpath(url)) {
+        _fatalError = QObject::tr("Can't create directory\n%1").arg(url);
+        return false;
+    }
+    // Saving back to source directory rewrites only added and changed contacts
+    // and removes files of deleted ones; other files in directory are kept.
+    // List without source directory adopts this one
+    bool sameDir = !list.originalPath.isEmpty()
+        && QFileInfo(list.originalPath).absoluteFilePath()==QFileInfo(url).absoluteFilePath();
+    bool adopt = sameDir || list.originalPath.isEmpty();
+    // File names are compared case-insensitive, for FAT and NTFS
+    QSet<QString> existing;
+    foreach (const QString& fileName, QDir(url).entryList(QStringList("*.vcf"), QDir::Files))
+        existing << fileName.toLower();
+    QHash<QString, int> usage;
+    foreach (const ContactItem& item, list)
+        if (!item.fileName.isEmpty())
+            usage[item.fileName.toLower()]++;
+    // In source directory, contact keeps its file name; file shared by
+    // several contacts stays with first of them. Names from other sources
+    // (other directory, CardDAV resource path) aren't reused
+    QSet<QString> claimed;
+    QStringList fileNames;
+    QList<int> changed;
+    for (int i=0; i<list.count(); i++) {
+        const ContactItem& item = list[i];
+        QString key = item.fileName.toLower();
+        if (sameDir && !item.fileName.isEmpty() && !claimed.contains(key)) {
+            claimed << key;
+            fileNames << item.fileName;
+            if (item.modified || usage[key]>1 || !existing.contains(key))
+                changed << i;
+        }
+        else {
+            fileNames << QString();
+            changed << i;
+        }
+    }
+    // Files of deleted contacts may be overwritten, foreign files may not
+    QSet<QString> removed;
+    if (sameDir)
+        foreach (const QString& fileName, list.removedFiles)
+            removed << fileName.toLower();
+    // New contacts are named by id/UID, if any, else by first free number
+    int number = 1;
+    for (int i=0; i<list.count(); i++) {
+        if (!fileNames[i].isEmpty())
+            continue;
+        QString fileName = idFileName(list[i]);
+        QString key = fileName.toLower();
+        if (fileName.isEmpty() || claimed.contains(key)
+                || (existing.contains(key) && !removed.contains(key))) {
+            do {
+                fileName = QString("%1.vcf").arg((uint)(number++), 4, 10, QChar('0'));
+            } while (claimed.contains(fileName.toLower()) || existing.contains(fileName.toLower()));
+        }
+        claimed << fileName.toLower();
+        fileNames[i] = fileName;
+    }
+    qSort(changed);
+    QThreadPool pool;
+    QList<VCFDirExportTask*> tasks;
+    for (int i=0; i<changed.count(); i+=VCF_DIR_BATCH_SIZE) {
+        VCFDirExportTask* task = new VCFDirExportTask(list, url);
+        task->indices = changed.mid(i, VCF_DIR_BATCH_SIZE);
+        foreach (int index, task->indices)
+            task->fileNames << fileNames[index];
+        tasks << task;
+        pool.start(task);
+    }
+    pool.waitForDone();
+    bool res = true;
+    foreach (VCFDirExportTask* task, tasks) {
+        _errors << task->errors;
+        if (res && !task->fatalError.isEmpty()) {
+            _fatalError = task->fatalError;
+            res = false;
+        }
+        delete task;
+    }
+    if (!res)
+        return false;
+    // Only files known as own files of deleted contacts are removed,
+    // not ones added to directory by other programs
+    if (sameDir) {
+        foreach (const QString& fileName, list.removedFiles)
+            if (!claimed.contains(fileName.toLower()) && existing.contains(fileName.toLower())
+                    && !QFile::remove(url + QDir::separator() + fileName))
+                _errors << QObject::tr("Can't remove file %1").arg(fileName);
+        list.removedFiles.clear();
+    }
+    if (adopt) {
+        list.originalPath = url;
+        for (int i=0; i<list.count(); i++) {
+            list[i].fileName = fileNames[i];
+            list[i].modified = false;
+        }
+    }
+    return true;
+}
+
+bool VCFDirectory::readFile(const QString &path, QByteArray &raw, QString &fatalError)
+{
+    QFile f(path);
+    if (!f.open(QIODevice::ReadOnly)) {
+        fatalError = S_READ_ERR.arg(path);
+        return false;
+    }
+    raw = f.readAll();
+    f.close();
+    return true;
+}
+
+bool VCFDirectory::writeFile(const QString &path, const QStringList &content, QString &fatalError)
+{
+    // Whole file is formed in memory and written at once
+    QString text;
+    foreach (const QString& line, content) {
+        text += line;
+        text += "\r\n";
+    }
+    // Old file content is replaced only by completely written new one
+#if QT_VERSION >= 0x050100
+    QSaveFile f(path);
+    if (!f.open(QIODevice::WriteOnly)
+            || f.write(QTextCodec::codecForLocale()->fromUnicode(text))==-1
+            || !f.commit()) {
+        fatalError = S_WRITE_ERR.arg(path);
+        return false;
+    }
+#else
+    QFile f(path + ".new");
+    if (!f.open(QIODevice::WriteOnly)
+            || f.write(QTextCodec::codecForLocale()->fromUnicode(text))==-1) {
+        f.remove();
+        fatalError = S_WRITE_ERR.arg(path);
+        return false;
+    }
+    f.close();
+    if (f.error()!=QFile::NoError) {
+        f.remove();
+        fatalError = S_WRITE_ERR.arg(path);
+        return false;
+    }
+    QFile::remove(path);
+    if (!f.rename(path)) {
+        fatalError = S_WRITE_ERR.arg(path);
+        return false;
+    }
+#endif
+    return true;
+}
+
+QString VCFDirectory::idFileName(const ContactItem &item)
+{
+    QString name;
+    foreach (const QChar& c, item.id.left(VCF_DIR_MAX_ID_NAME_LENGTH)) {
+        if ((c.isLetterOrNumber() && c.unicode()<128) || c=='.' || c=='_' || c=='@' || c=='-')
+            name += c;
+        else
+            name += '_';
+    }
+    // Hidden files aren't wanted
+    if (name.startsWith('.'))
+        name[0] = '_';
+    return name.isEmpty() ? name : name + ".vcf";
+}
+
+QString VCFDirectory::manifestPath(const QString &url)
+{
+    // Manifest is kept out of user directory, one per absolute directory path
+    return AsyncFormat::cacheDir() + QDir::separator() + QString::fromLatin1(
+        QCryptographicHash::hash(QFileInfo(url).absoluteFilePath().toUtf8(), QCryptographicHash::Sha1).toHex())
+        + ".vcfdir";
+}
+
+QString VCFDirectory::manifestSettings()
+{
+    return VCardData::importSettings() + QString(";%1").arg(gd.readNamesFromFileName ? 1 : 0);
+}
+
+void VCFDirectory::loadManifest(const QString &url, QHash<QString, VCFDirEntry *> &entries)
+{
+    QFile f(manifestPath(url));
+    if (!f.open(QIODevice::ReadOnly))
+        return;
+    QDataStream stream(&f);
+    stream.setVersion(QDataStream::Qt_4_6);
+    quint32 magic, version;
+    QString settings;
+    qint32 count;
+    stream >> magic >> version;
+    if (magic!=VCF_DIR_MANIFEST_MAGIC || version!=VCF_DIR_MANIFEST_VERSION)
+        return;
+    stream >> settings >> count;
+    // Manifest made with other parsing settings is useless
+    if (stream.status()!=QDataStream::Ok || settings!=manifestSettings())
+        return;
+    for (qint32 i=0; i<count && stream.status()==QDataStream::Ok; i++) {
+        VCFDirEntry* entry = new VCFDirEntry;
+        qint32 itemCount;
+        stream >> entry->fileName >> entry->modified >> entry->size >> entry->hash
+               >> entry->errors >> itemCount;
+        for (qint32 j=0; j<itemCount && stream.status()==QDataStream::Ok; j++) {
+            ContactItem item;
+            stream >> item;
+            entry->items.appendSwapped(item);
+        }
+        entry->cached = true;
+        delete entries.value(entry->fileName, 0);
+        entries[entry->fileName] = entry;
+    }
+    f.close();
+    // Damaged manifest
+    if (stream.status()!=QDataStream::Ok) {
+        qDeleteAll(entries);
+        entries.clear();
+    }
+}
+
+void VCFDirectory::saveManifest(const QString &url, const QList<VCFDirEntry *> &entries)
+{
+    // Manifest is only a cache, so write errors are ignored
+    if (!QDir().mkpath(AsyncFormat::cacheDir()))
+        return;
+    QString path = manifestPath(url);
+    QFile f(path + ".new");
+    if (!f.open(QIODevice::WriteOnly))
+        return;
+    QDataStream stream(&f);
+    stream.setVersion(QDataStream::Qt_4_6);
+    stream << (quint32)VCF_DIR_MANIFEST_MAGIC << (quint32)VCF_DIR_MANIFEST_VERSION
+           << manifestSettings() << (qint32)entries.count();
+    foreach (const VCFDirEntry* entry, entries) {
+        stream << entry->fileName << entry->modified << entry->size << entry->hash
+               << entry->errors << (qint32)entry->items.count();
+        foreach (const ContactItem& item, entry->items)
+            stream << item;
+    }
+    f.close();
+    if (stream.status()!=QDataStream::Ok || f.error()!=QFile::NoError) {
+        f.remove();
+        return;
+    }
+    QFile::remove(path);
+    QFile::rename(path + ".new", path);
+}
+
+VCFDirEntry::VCFDirEntry()
+    :size(0), cached(false)
+{
+}
+
+VCFDirImportTask::VCFDirImportTask(const QString &dirPath)
+    :QRunnable(), _dirPath(dirPath)
+{
+    setAutoDelete(false);
+}
+
+void VCFDirImportTask::run()
+{
+    VCardData data;
+    foreach (VCFDirEntry* entry, entries) {
+        QByteArray raw;
+        if (!VCFDirectory::readFile(_dirPath + QDir::separator() + entry->fileName, raw, fatalError))
+            return;
+        // Only touched, but not changed?
+        QByteArray hash = QCryptographicHash::hash(raw, QCryptographicHash::Sha1);
+        if (entry->cached && hash==entry->hash)
+            continue;
+        entry->hash = hash;
+        entry->items.clear();
+        entry->errors.clear();
         QStringList content;
-        QTextStream stream(&file);
+        QTextStream stream(&raw, QIODevice::ReadOnly);
         do {
             content.push_back(stream.readLine());
         } while (!stream.atEnd());
-        closeFile();
         // Append one contact to list!
-        data.importRecords(content, list, true, _errors);
-        if (gd.readNamesFromFileName) {
-            QString contName = fileName;
+        data.importRecords(content, entry->items, true, entry->errors);
+        if (gd.readNamesFromFileName && !entry->items.isEmpty()) {
+            QString contName = entry->fileName;
             contName.remove(".vcf");
             contName.remove(".VCF");
-            list.last().names.clear();
-            list.last().names << contName;
-            list.last().fullName = contName;
+            entry->items.last().names.clear();
+            entry->items.last().names << contName;
+            entry->items.last().fullName = contName;
         }
+        entry->cached = true;
     }
-    return true;
 }
 
-bool VCFDirectory::exportRecords(const QString &url, ContactList &list)
+VCFDirExportTask::VCFDirExportTask(const ContactList &list, const QString &dirPath)
+    :QRunnable(), _list(list), _dirPath(dirPath)
+{
+    setAutoDelete(false);
+}
+
+void VCFDirExportTask::run()
 {
-    QDir d;
-    d.rmpath(url);
-    if (!d.mkpath(url)) {
-        _fatalError = QObject::tr("Can't create directory\n%1").arg(url);
-        return false;
-    }
-    int i = 1;
     VCardData data;
-    foreach(const ContactItem& item, list) {
-        // TODO use id, if present, in filename?
-        QString fileName = url + QDir::separator() + QString("%1.vcf").arg((uint)i, 4, 10, QChar('0'));
+    for (int i=0; i<indices.count(); i++) {
         QStringList content;
-        data.exportRecord(content, item, _errors);
-        if (!openFile(fileName, QIODevice::WriteOnly))
-            return false;
-        QTextStream stream(&file);
-        foreach (const QString line, content)
-            stream << line << (char)13 << endl;
-        closeFile();
-        i++;
+        data.exportRecord(content, _list[indices[i]], errors);
+        if (!VCFDirectory::writeFile(_dirPath + QDir::separator() + fileNames[i], content, fatalError))
+            return;
     }
-    return true;
 }
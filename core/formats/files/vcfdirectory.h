@@ -14,8 +14,34 @@
 #ifndef VCFDIR_H
 #define VCFDIR_H
 
+#include <QDateTime>
+#include <QHash>
+#include <QRunnable>
 #include "fileformat.h"
 
+// Files per one parallel import/export task
+#define VCF_DIR_BATCH_SIZE 256
+
+// Cached parsed directory content, to re-read only changed files
+#define VCF_DIR_MANIFEST_MAGIC 0x44434D46
+#define VCF_DIR_MANIFEST_VERSION 2
+
+// Longest file name made from contact id/UID (without extension)
+#define VCF_DIR_MAX_ID_NAME_LENGTH 64
+
+// Manifest record of one directory file
+struct VCFDirEntry
+{
+    QString fileName;
+    QDateTime modified;
+    qint64 size;
+    QByteArray hash; // SHA-1 of file content
+    ContactList items;
+    QStringList errors;
+    bool cached; // items were taken from manifest
+    VCFDirEntry();
+};
+
 class VCFDirectory : public FileFormat
 {
 public:
@@ -26,6 +52,42 @@ public:
 public:
     bool importRecords(const QString &url, ContactList &list, bool append);
     bool exportRecords(const QString &url, ContactList &list);
+    // Per-file helpers, used from worker threads
+    static bool readFile(const QString& path, QByteArray& raw, QString& fatalError);
+    static bool writeFile(const QString& path, const QStringList& content, QString& fatalError);
+private:
+    static QString idFileName(const ContactItem& item);
+    static QString manifestPath(const QString& url);
+    static QString manifestSettings();
+    void loadManifest(const QString& url, QHash<QString, VCFDirEntry*>& entries);
+    void saveManifest(const QString& url, const QList<VCFDirEntry*>& entries);
+};
+
+// Batch of new or changed directory files, read and parsed in worker thread
+class VCFDirImportTask : public QRunnable
+{
+public:
+    VCFDirImportTask(const QString& dirPath);
+    void run();
+    QList<VCFDirEntry*> entries;
+    QString fatalError;
+private:
+    QString _dirPath;
+};
+
+// Batch of contacts, formatted and written in worker thread
+class VCFDirExportTask : public QRunnable
+{
+public:
+    VCFDirExportTask(const ContactList& list, const QString& dirPath);
+    void run();
+    QList<int> indices;
+    QStringList fileNames;
+    QStringList errors;
+    QString fatalError;
+private:
+    const ContactList& _list;
+    QString _dirPath;
 };
 
 #endif // VCFDIR_H
@@ -21,13 +21,13 @@ VCFFile::VCFFile()
 
 bool VCFFile::detect(const QString &url)
 {
-    QFile f(url);
-    if (!f.open(QIODevice::ReadOnly)) return false;
-    QTextStream stream(&f);
-    QString s1 = stream.readLine();
-    bool res = s1.startsWith("BEGIN:VCARD", Qt::CaseInsensitive);
-    f.close();
-    return res;
+    return detectScore(FileHeader(url))!=NotDetected;
+}
+
+int VCFFile::detectScore(const FileHeader &header)
+{
+    return header.firstLine.startsWith("BEGIN:VCARD", Qt::CaseInsensitive)
+        ? SureDetected : NotDetected;
 }
 
 QStringList VCFFile::supportedExtensions()
@@ -14,6 +14,7 @@
 #include <QDomNodeList>
 #include <QStringList>
 #include <QTextStream>
+#include <QXmlStreamReader>
 #include "xmlcontactfile.h"
 
 XmlContactFile::XmlContactFile()
@@ -23,18 +24,20 @@ XmlContactFile::XmlContactFile()
 
 bool XmlContactFile::detect(const QString &url)
 {
-    QFile file(url);
-    // - file is readable
-    if (!file.open( QIODevice::ReadOnly))
-        return false;
-    // - file is XML
-    QDomDocument doc;
-    if (!doc.setContent(&file)) {
-        file.close();
-        return false;
+    return detectScore(FileHeader(url))!=NotDetected;
+}
+
+int XmlContactFile::detectScore(const FileHeader &header)
+{
+    // File is XML with contact element; file start can't be checked
+    // by DOM parser, so reader stops at end of header
+    QXmlStreamReader xml(header.raw);
+    while (!xml.atEnd()) {
+        xml.readNext();
+        if (xml.isStartElement() && xml.name()==QLatin1String("contact"))
+            return LikelyDetected;
     }
-    file.close();
-    return !(doc.elementsByTagName("contact").isEmpty());
+    return NotDetected;
 }
 
 QStringList XmlContactFile::supportedExtensions()
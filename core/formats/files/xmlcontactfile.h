@@ -24,6 +24,7 @@ public:
     XmlContactFile();
     // IFormat interface
     static bool detect(const QString &url);
+    static int detectScore(const FileHeader& header);
     static QStringList supportedExtensions();
     static QStringList supportedFilters();
     bool importRecords(const QString &url, ContactList &list, bool append);
@@ -2,6 +2,8 @@
 #include <QFileInfo>
 #include <QObject>
 
+#include "globals.h"
+
 #include "files/csvfile.h"
 #include "files/htmlfile.h"
 #include "files/mpbfile.h"
@@ -13,6 +15,39 @@
 #include "files/vcffile.h"
 #include "files/xmlcontactfile.h"
 
+template<class T> static IFormat* createFormat()
+{
+    return new T();
+}
+
+static FormatSignature signature(const QByteArray& magic, FormatDetector detector, FormatCreator creator)
+{
+    FormatSignature sig;
+    sig.magic = magic;
+    sig.detector = detector;
+    sig.creator = creator;
+    return sig;
+}
+
+static QList<FormatSignature> makeSignatures()
+{
+    // On equal score, earlier format wins
+    QList<FormatSignature> res;
+    res << signature(QByteArray(), &VCFFile::detectScore, &createFormat<VCFFile>);
+    res << signature(QByteArray(), &UDXFile::detectScore, &createFormat<UDXFile>);
+#if QT_VERSION >= 0x040800
+    res << signature(QByteArray(), &MPBFile::detectScore, &createFormat<MPBFile>);
+#endif
+    res << signature(QByteArray("PK\x03\x04", 4), &NBFFile::detectScore, &createFormat<NBFFile>);
+#ifndef USE_GPL2
+    res << signature(QByteArray("\xCC\x52\x33\xFC", 4), &NBUFile::detectScore, &createFormat<NBUFile>);
+#endif
+    res << signature(QByteArray(), &XmlContactFile::detectScore, &createFormat<XmlContactFile>);
+    res << signature(QByteArray(), &CSVFile::detectScore, &createFormat<CSVFile>);
+    // ...here add detectScore() for new format
+    return res;
+}
+
 FormatFactory::FormatFactory()
     :error("")
 {
@@ -105,26 +140,37 @@ IFormat *FormatFactory::createObject(const QString &url)
         return new HTMLFile();
     // ...here add supportedExtensions() for new format
     // Known formats with non-standard extension
-    if (VCFFile::detect(url))
-        return new VCFFile();
-    if (UDXFile::detect(url))
-        return new UDXFile();
-#if QT_VERSION >= 0x040800
-    if (MPBFile::detect(url))
-        return new MPBFile();
-#endif
-    if (NBFFile::detect(url))
-        return new NBFFile();
-#ifndef USE_GPL2
-    if (NBUFile::detect(url))
-        return new NBUFile();
-#endif
-    if (XmlContactFile::detect(url))
-        return new XmlContactFile();
-    if (CSVFile::detect(url))
-        return new CSVFile();
-    // ...here add detect() for new format
+    return detectObject(url);
+}
+
+IFormat *FormatFactory::detectObject(const QString &url)
+{
+    FileHeader header(url);
+    if (!header.isRead) {
+        error = S_READ_ERR.arg(url);
+        return 0;
+    }
+    const QList<FormatSignature>& sigs = signatures();
+    int best = -1;
+    int bestScore = FileFormat::NotDetected;
+    for (int i=0; i<sigs.count(); i++) {
+        if (!sigs[i].magic.isEmpty() && !header.startsWith(sigs[i].magic))
+            continue;
+        int score = sigs[i].detector(header);
+        if (score>bestScore) {
+            best = i;
+            bestScore = score;
+        }
+    }
+    if (best!=-1)
+        return sigs[best].creator();
     // Sad but true
     error = QObject::tr("Unknown file format:\n%1").arg(url);
     return 0;
 }
+
+const QList<FormatSignature> &FormatFactory::signatures()
+{
+    static const QList<FormatSignature> res = makeSignatures();
+    return res;
+}
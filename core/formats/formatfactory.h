@@ -16,6 +16,17 @@
 #include <QIODevice>
 #include <QStringList>
 #include "iformat.h"
+#include "files/fileformat.h"
+
+// Content-based detection of one file format
+typedef int (*FormatDetector)(const FileHeader& header);
+typedef IFormat* (*FormatCreator)();
+struct FormatSignature
+{
+    QByteArray magic; // file start, checked before detector; empty for text formats
+    FormatDetector detector;
+    FormatCreator creator;
+};
 
 class FormatFactory
 {
@@ -23,7 +34,11 @@ public:
     FormatFactory();
     static QStringList supportedFilters(QIODevice::OpenMode mode, bool isReportFormat);
     IFormat* createObject(const QString& url);
+    // By content only; file is opened once for all formats
+    IFormat* detectObject(const QString& url);
     QString error;
+private:
+    static const QList<FormatSignature>& signatures();
 };
 
 #endif // FORMATFACTORY_H
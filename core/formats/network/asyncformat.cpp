@@ -11,11 +11,15 @@
  *
  */
 
-#include <QMutex>
+#include <QDir>
+#include <QEventLoop>
+#if QT_VERSION >= 0x050000
+#include <QStandardPaths>
+#endif
 #include "asyncformat.h"
 
 AsyncFormat::AsyncFormat()
-    :state(StateOff), ui(0)
+    :state(StateOff), ui(0), result(false)
 {
 }
 
@@ -24,6 +28,25 @@ void AsyncFormat::setUI(IAsyncUI *ptr)
     ui = ptr;
 }
 
+bool AsyncFormat::isRunning() const
+{
+    return state!=StateOff;
+}
+
+bool AsyncFormat::importRecords(const QString &url, ContactList &list, bool append)
+{
+    if (!startImport(url, list, append))
+        return false;
+    return waitForFinished();
+}
+
+bool AsyncFormat::exportRecords(const QString &url, ContactList &list)
+{
+    if (!startExport(url, list))
+        return false;
+    return waitForFinished();
+}
+
 QStringList AsyncFormat::errors()
 {
     return _errors;
@@ -34,10 +57,33 @@ QString AsyncFormat::fatalError()
     return _fatalError;
 }
 
-void AsyncFormat::pause(int msecs)
+QString AsyncFormat::cacheDir()
+{
+    // Common for GUI and console application
+    // (QDesktopServices of Qt 4 isn't available without GUI)
+    return
+        #if QT_VERSION >= 0x050000
+            QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation)
+        #else
+            QDir::homePath() + QDir::separator() + ".cache"
+        #endif
+            + QDir::separator() + "doublecontact";
+}
+
+void AsyncFormat::finish(bool success)
+{
+    state = StateOff;
+    result = success;
+    emit finished(success);
+}
+
+bool AsyncFormat::waitForFinished()
 {
-    QMutex mutex;
-    mutex.lock();
-    mutex.tryLock(msecs);
-    mutex.unlock();
+    // Operation may be already finished inside start...()
+    if (isRunning()) {
+        QEventLoop loop;
+        connect(this, SIGNAL(finished(bool)), &loop, SLOT(quit()));
+        loop.exec();
+    }
+    return result;
 }
@@ -23,14 +23,25 @@
 
 class IAsyncUI;
 
+// Network operation runs in event loop of caller and reports end by signal;
+// blocking IFormat interface waits for it in local event loop
 class AsyncFormat : public QObject, public IFormat
 {
     Q_OBJECT
 public:
     AsyncFormat();
     void setUI(IAsyncUI* ptr);
+    // Return false, if operation can't be started
+    virtual bool startImport(const QString& url, ContactList& list, bool append)=0;
+    virtual bool startExport(const QString& url, ContactList& list)=0;
+    bool isRunning() const;
+    // IFormat interface
+    bool importRecords(const QString& url, ContactList& list, bool append);
+    bool exportRecords(const QString& url, ContactList& list);
     QStringList errors();
     QString fatalError();
+    // Directory for local copies of network data
+    static QString cacheDir();
 protected:
     enum State {
         StateOff,
@@ -43,10 +54,14 @@ protected:
     QStringList _errors;
     QString _fatalError;
     IAsyncUI* ui;
-    void pause(int msecs);
+    void finish(bool success);
+private:
+    bool result;
+    bool waitForFinished();
 signals:
     void connected();
     void progress(const QString& stage, int progress, int total);
+    void finished(bool success);
 };
 
 class IAsyncUI {
@@ -10,39 +10,91 @@
  * (at your option) any later version. See COPYING file for more details.
  *
  */
-#include <QCoreApplication>
+#include <QBuffer>
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QSet>
+#include <QTimer>
 #include <QUrl>
 #include <QUuid>
+#include <QXmlStreamWriter>
 #include "carddavformat.h"
 
+CardDAVEntry::CardDAVEntry()
+    :deleted(false)
+{
+}
+
+CardDAVUpload::CardDAVUpload()
+    :index(-1), ifNoneMatch(false), attempt(0), retryAt(0), done(false)
+{
+}
+
 CardDAVFormat::CardDAVFormat() :
-    AsyncFormat(), readingList(0)
+    AsyncFormat(), port(-1), operation(ReadBook), readingList(0), readingListWasEmpty(false), writingList(0),
+    maxRequests(CARDDAV_MAX_REQUESTS), cacheChanged(false), fetchFailed(false),
+    fetchTotal(0), doneFetch(0), pendingRetries(0), uploadTotal(0), doneUpload(0)
 {
+    // RFC 6352 servers must accept vCard 3.0 only, whatever is preferred for files
+    forceVersion(GlobalConfig::VCF30);
+    connect(&w, SIGNAL(errorChanged(QString)), this, SLOT(onError(QString)));
+    connect(&w, SIGNAL(checkSslCertifcate(QList<QSslError>)), this, SLOT(processSslCertifcate(QList<QSslError>)));
 }
 
-bool CardDAVFormat::importRecords(const QString &url, ContactList &list, bool append)
+bool CardDAVFormat::startImport(const QString &url, ContactList &list, bool append)
+{
+    if (isRunning() || !openSession(url))
+        return false;
+    if (!append)
+        list.clear();
+    readingListWasEmpty = list.isEmpty();
+    readingList = &list;
+    operation = ReadBook;
+    startSession();
+    return true;
+}
+
+bool CardDAVFormat::startExport(const QString &url, ContactList &list)
+{
+    if (isRunning() || !openSession(url))
+        return false;
+    writingList = &list;
+    operation = WriteBook;
+    startSession();
+    return true;
+}
+
+bool CardDAVFormat::openSession(const QString &url)
 {
     _url = url;
-    QUrl u(_url);
+    u = QUrl(_url);
     if (!u.isValid()) {
         _fatalError = tr("Invalid URL");
         return false;
     }
-    int port = u.port();
+    port = u.port();
     // Optional components
     if (port==-1) // Standard port, if absent
         port = (u.scheme()=="http" ? 80 : 443);
-    QString userName = u.userName();
+    host = u.host();
+    userName = u.userName();
     if (userName.isEmpty())
         userName = ui->inputLogin();
     if (userName.isEmpty())
         return false;
-    QString password = u.password();
+    password = u.password();
     if (password.isEmpty())
         password = ui->inputPassword();
     if (password.isEmpty())
         return false;
-    // qDebug() << u.scheme() << " :// " << userName << " : " << password << " @ " << u.host() << " : " << port << " / " << u.path(); //===>
+    _errors.clear();
+    _fatalError.clear();
+    digMd5 = "";
+    digSha1 = "";
     // TODO Google stub - move to separate proc, 2-4 weeks
 /*    w.setConnectionSettings(QWebdav::HTTPS,
         "https://www.googleapis.com", "/.well-known/carddav", userName, password);
@@ -56,65 +108,64 @@ bool CardDAVFormat::importRecords(const QString &url, ContactList &list, bool ap
     connect(r, SIGNAL(finished()), this, SLOT(urlReqFinished()));
     connect(r, SIGNAL(error(QNetworkReply::NetworkError)), this, SLOT(urlReqError(QNetworkReply::NetworkError)));*/
     // TODO End of Google stub
+    // Cache is per addressbook and user, password isn't a part of key
+    QUrl cacheKey(u);
+    cacheKey.setUserName(userName);
+    cacheKey.setPassword("");
+    cacheKey.setPort(port);
+    cachePath = cacheDir() + QDir::separator() + QString::fromLatin1(
+        QCryptographicHash::hash(cacheKey.toString().toUtf8(), QCryptographicHash::Sha1).toHex())
+        + ".carddav";
+    loadCache();
+    return true;
+}
+
+void CardDAVFormat::startSession()
+{
     // TODO show connecting state
     // WebDAV settings
-    if (!append)
-        list.clear();
-    readingList = &list;
-    connect(&p, SIGNAL(finished()), this, SLOT(onFinish()));
-    connect(&p, SIGNAL(errorChanged(QString)), this, SLOT(onError(QString)));
-    connect(&w, SIGNAL(errorChanged(QString)), this, SLOT(onError(QString)));
-    connect(&w, SIGNAL(checkSslCertifcate(QList<QSslError>)), this, SLOT(processSslCertifcate(QList<QSslError>)));
-    digMd5 = "";
-    digSha1 = "";
-    do {
-        state = StateConnect;
-        w.setConnectionSettings(
-            (u.scheme()=="http" ? QWebdav::HTTP : QWebdav::HTTPS),
-            u.host(), u.path(), userName, password, port, digMd5, digSha1);
-        p.listDirectory(&w, "/"); // ==> only for read???
-        do {
-            qApp->processEvents();
-            pause(50); // min 14 for Win8
-        } while (state!=StateOff && state!=StateSSLRequest);
-        if (state==StateSSLRequest) {
-            qApp->processEvents();
-            QString q = tr("There are security problems:\n    %1\nAre you want to accept this certificate anyway?")
-                .arg(sslMessages.join("\n    "));
-            if (!ui->securityConfirm(q)) {
-                readingList = 0;
-                return false;
-            }
-        }
-    } while (state!=StateOff);
-    // TODO writing test begin - still not work
-/*    QUuid id = QUuid::createUuid();
-    QString sId = id.toString();
-    sId.remove("{");
-    sId.remove("}");
-    path = PATH_CARDDAV_OWNCLOUD.arg(user) + "/" + sId + ".vcf";
-    QString cont = "BEGIN:VCARD\n";
-    cont += "FN:Full newbie\n";
-    cont += QString("UID:%1\n").arg(sId);
-    cont += "END:VCARD\n";
-    QNetworkReply* rc = w.mkdir(path);
-    connect(rc, SIGNAL(finished()), this, SLOT(writeFinished()));
-    while (!rc->isFinished())
-        qApp->processEvents();
-    qDebug() << path;
-    QNetworkReply* rp = w.put(path, cont.toLocal8Bit().data());
-    connect(rp, SIGNAL(finished()), this, SLOT(writeFinished()));
-    while (!rp->isFinished())
-        qApp->processEvents();*/
-    // TODO writing test end
+    state = StateConnect;
+    sslMessages.clear();
+    w.setConnectionSettings(
+        (u.scheme()=="http" ? QWebdav::HTTP : QWebdav::HTTPS),
+        u.host(), u.path(), userName, password, port, digMd5, digSha1);
+    startListing();
+}
+
+void CardDAVFormat::confirmCertificate()
+{
+    QString q = tr("There are security problems:\n    %1\nAre you want to accept this certificate anyway?")
+        .arg(sslMessages.join("\n    "));
+    // Next attempt accepts certificate with these digests
+    if (ui->securityConfirm(q))
+        startSession();
+    else
+        endSession(false);
+}
+
+void CardDAVFormat::endSession(bool success)
+{
+    success = success && _fatalError.isEmpty();
+    // Contacts of one addressbook can be written back by changes;
+    // mixed sources can't. Source file of append-only format (NBF) is kept
+    if (readingList && success) {
+        if (readingListWasEmpty)
+            readingList->originalPath = _url;
+        else if (readingList->originalPath!=_url && !QFileInfo(readingList->originalPath).isFile())
+            readingList->originalPath.clear();
+    }
     readingList = 0;
-    return _fatalError.isEmpty();
+    writingList = 0;
+    closeSession();
+    finish(success);
 }
 
-bool CardDAVFormat::exportRecords(const QString &url, ContactList &list)
+void CardDAVFormat::closeSession()
 {
-    // TODO
-    return false;
+    cachedEntries.clear();
+    entries.clear();
+    entryIndexes.clear();
+    uploads.clear();
 }
 
 QNetworkAccessManager *CardDAVFormat::netManager()
@@ -122,6 +173,394 @@ QNetworkAccessManager *CardDAVFormat::netManager()
     return &w;
 }
 
+void CardDAVFormat::setMaxRequests(int count)
+{
+    maxRequests = qMax(count, 1);
+}
+
+QNetworkRequest CardDAVFormat::davRequest(const QString &path)
+{
+    // Same URL as QWebdav forms, but request attributes are own
+    QUrl reqUrl;
+    reqUrl.setScheme(w.isSSL() ? "https" : "http");
+    reqUrl.setHost(w.hostname());
+    if (w.port()!=-1)
+        reqUrl.setPort(w.port());
+    reqUrl.setPath(w.rootPath() + path);
+    QNetworkRequest req(reqUrl);
+    // Connections are kept alive by QNetworkAccessManager for HTTP/1.1
+    req.setAttribute(QNetworkRequest::HttpPipeliningAllowedAttribute, true);
+#if QT_VERSION >= 0x050800
+    req.setAttribute(QNetworkRequest::HTTP2AllowedAttribute, true);
+#endif
+    return req;
+}
+
+QNetworkReply *CardDAVFormat::sendDavRequest(const QByteArray &method, const QString &path,
+    const QByteArray &depth, const QByteArray &body)
+{
+    QNetworkRequest req = davRequest(path);
+    if (!depth.isEmpty())
+        req.setRawHeader("Depth", depth);
+    req.setHeader(QNetworkRequest::ContentTypeHeader, "application/xml; charset=utf-8");
+    req.setHeader(QNetworkRequest::ContentLengthHeader, body.size());
+    QBuffer* data = new QBuffer;
+    data->setData(body);
+    data->open(QIODevice::ReadOnly);
+    QNetworkReply* reply = w.sendCustomRequest(req, method, data);
+    data->setParent(reply);
+    return reply;
+}
+
+QString CardDAVFormat::relativePath(const QString &href)
+{
+    // Servers may return href with or without scheme and authority
+    QString path = QUrl::fromPercentEncoding(href.trimmed().toUtf8());
+    if (path.startsWith("http"))
+        path = QUrl(path).path();
+    if (path.startsWith(w.rootPath()))
+        path.remove(0, w.rootPath().length());
+    return path;
+}
+
+int CardDAVFormat::statusCode(const QString &status)
+{
+    // HTTP/1.1 200 OK
+    return status.trimmed().section(' ', 1, 1).toInt();
+}
+
+void CardDAVFormat::parseMultistatus(const QByteArray &data, QList<CardDAVResponse> &responses, bool &truncated)
+{
+    QXmlStreamReader xml(data);
+    CardDAVResponse resp;
+    QString text, propEtag;
+    int propStatus = 0;
+    bool inResponse = false, inPropstat = false, propCollection = false;
+    truncated = false;
+    while (!xml.atEnd()) {
+        xml.readNext();
+        if (xml.isStartElement()) {
+            text.clear();
+            if (xml.namespaceUri()!=QLatin1String("DAV:"))
+                continue;
+            if (xml.name()==QLatin1String("response")) {
+                inResponse = true;
+                resp.path.clear();
+                resp.status = 0;
+                resp.etag.clear();
+                resp.isCollection = false;
+            }
+            else if (xml.name()==QLatin1String("propstat")) {
+                inPropstat = true;
+                propStatus = 0;
+                propEtag.clear();
+                propCollection = false;
+            }
+            else if (xml.name()==QLatin1String("collection"))
+                propCollection = true;
+        }
+        else if (xml.isCharacters())
+            text += xml.text();
+        else if (xml.isEndElement() && xml.namespaceUri()==QLatin1String("DAV:")) {
+            if (xml.name()==QLatin1String("href") && inResponse && !inPropstat)
+                resp.path = relativePath(text);
+            else if (xml.name()==QLatin1String("status")) {
+                if (inPropstat)
+                    propStatus = statusCode(text);
+                else if (inResponse)
+                    resp.status = statusCode(text);
+            }
+            else if (xml.name()==QLatin1String("getetag"))
+                propEtag = text.trimmed();
+            // Collection property (PROPFIND) or report element (sync-collection)
+            else if (xml.name()==QLatin1String("sync-token")) {
+                if (!inResponse || (inPropstat && !text.trimmed().isEmpty()))
+                    syncToken = text.trimmed();
+            }
+            else if (xml.name()==QLatin1String("propstat")) {
+                inPropstat = false;
+                if (propStatus==200) {
+                    resp.status = 200;
+                    resp.etag = propEtag;
+                    resp.isCollection = propCollection;
+                }
+            }
+            else if (xml.name()==QLatin1String("response")) {
+                inResponse = false;
+                // Addressbook itself
+                if (resp.path.isEmpty() || resp.path=="/") {
+                    if (resp.status==507)
+                        truncated = true;
+                }
+                else
+                    responses << resp;
+            }
+        }
+    }
+}
+
+void CardDAVFormat::loadCache()
+{
+    cachedSyncToken.clear();
+    cachedEntries.clear();
+    QFile f(cachePath);
+    if (!f.open(QIODevice::ReadOnly))
+        return;
+    QDataStream stream(&f);
+    stream.setVersion(QDataStream::Qt_4_6);
+    quint32 magic, version;
+    qint32 count;
+    stream >> magic >> version;
+    if (magic!=CARDDAV_CACHE_MAGIC || version!=CARDDAV_CACHE_VERSION)
+        return;
+    // Contacts parsed with other settings are read again
+    QString settings;
+    stream >> settings;
+    if (stream.status()!=QDataStream::Ok || settings!=VCardData::importSettings())
+        return;
+    stream >> cachedSyncToken >> count;
+    for (qint32 i=0; i<count && stream.status()==QDataStream::Ok; i++) {
+        CardDAVEntry entry;
+        qint32 itemCount;
+        stream >> entry.path >> entry.etag >> itemCount;
+        for (qint32 j=0; j<itemCount && stream.status()==QDataStream::Ok; j++) {
+            ContactItem item;
+            stream >> item;
+            entry.items.appendSwapped(item);
+        }
+        cachedEntries << entry;
+    }
+    f.close();
+    // Damaged cache
+    if (stream.status()!=QDataStream::Ok) {
+        cachedSyncToken.clear();
+        cachedEntries.clear();
+    }
+}
+
+void CardDAVFormat::saveCache()
+{
+    // Cache is optional, so write errors are ignored
+    if (!QDir().mkpath(cacheDir()))
+        return;
+    QFile f(cachePath + ".new");
+    if (!f.open(QIODevice::WriteOnly))
+        return;
+    int count = 0;
+    foreach (const CardDAVEntry& entry, entries)
+        if (!entry.deleted)
+            count++;
+    QDataStream stream(&f);
+    stream.setVersion(QDataStream::Qt_4_6);
+    // Without token, vCards failed to download will be found by PROPFIND next time
+    stream << (quint32)CARDDAV_CACHE_MAGIC << (quint32)CARDDAV_CACHE_VERSION
+           << VCardData::importSettings() << (fetchFailed ? QString() : syncToken) << (qint32)count;
+    foreach (const CardDAVEntry& entry, entries) {
+        if (entry.deleted)
+            continue;
+        stream << entry.path << entry.etag << (qint32)entry.items.count();
+        foreach (const ContactItem& item, entry.items)
+            stream << item;
+    }
+    f.close();
+    if (stream.status()!=QDataStream::Ok || f.error()!=QFile::NoError) {
+        f.remove();
+        return;
+    }
+    QFile::remove(cachePath);
+    QFile::rename(cachePath + ".new", cachePath);
+}
+
+void CardDAVFormat::startListing()
+{
+    activeReplies.clear();
+    activeMultigets.clear();
+    multigetQueue.clear();
+    getQueue.clear();
+    fetchTotal = 0;
+    doneFetch = 0;
+    cacheChanged = false;
+    fetchFailed = false;
+    syncToken = cachedSyncToken;
+    // Known addressbook is synchronized by changes only (RFC 6578),
+    // else its full listing is compared with cache by ETags.
+    // Writing needs full listing anyway
+    if (!syncToken.isEmpty() && operation==ReadBook) {
+        entries = cachedEntries;
+        entryIndexes.clear();
+        for (int i=0; i<entries.count(); i++)
+            entryIndexes[entries[i].path] = i;
+        sendSyncReport();
+    }
+    else {
+        QByteArray body;
+        QXmlStreamWriter writer(&body);
+        writer.writeStartDocument();
+        writer.writeNamespace("DAV:", "D");
+        writer.writeStartElement("DAV:", "propfind");
+        writer.writeStartElement("DAV:", "prop");
+        writer.writeEmptyElement("DAV:", "resourcetype");
+        writer.writeEmptyElement("DAV:", "getetag");
+        writer.writeEmptyElement("DAV:", "sync-token");
+        writer.writeEndElement();
+        writer.writeEndElement();
+        writer.writeEndDocument();
+        QNetworkReply* reply = sendDavRequest("PROPFIND", "/", "1", body);
+        connect(reply, SIGNAL(finished()), this, SLOT(propfindFinished()));
+    }
+}
+
+void CardDAVFormat::sendSyncReport()
+{
+    QByteArray body;
+    QXmlStreamWriter writer(&body);
+    writer.writeStartDocument();
+    writer.writeNamespace("DAV:", "D");
+    writer.writeStartElement("DAV:", "sync-collection");
+    writer.writeTextElement("DAV:", "sync-token", syncToken);
+    writer.writeTextElement("DAV:", "sync-level", "1");
+    writer.writeStartElement("DAV:", "prop");
+    writer.writeEmptyElement("DAV:", "getetag");
+    writer.writeEndElement();
+    writer.writeEndElement();
+    writer.writeEndDocument();
+    QNetworkReply* reply = sendDavRequest("REPORT", "/", "0", body);
+    connect(reply, SIGNAL(finished()), this, SLOT(syncFinished()));
+}
+
+void CardDAVFormat::startFetch()
+{
+    // vCards are requested by batches, if server supports it, else one by one
+    while (activeReplies.count()+activeMultigets.count()<maxRequests) {
+        if (!multigetQueue.isEmpty())
+            startMultiget();
+        else if (!getQueue.isEmpty()) {
+            int index = getQueue.takeFirst();
+            QNetworkReply* reply = w.QNetworkAccessManager::get(davRequest(entries[index].path));
+            activeReplies[reply] = index;
+            connect(reply, SIGNAL(finished()), this, SLOT(fetchFinished()));
+        }
+        else
+            break;
+    }
+    if (activeReplies.isEmpty() && activeMultigets.isEmpty())
+        finishFetch();
+}
+
+void CardDAVFormat::startMultiget()
+{
+    CardDAVMultiget* mg = new CardDAVMultiget;
+    QByteArray body;
+    QXmlStreamWriter writer(&body);
+    writer.writeStartDocument();
+    writer.writeNamespace("DAV:", "D");
+    writer.writeNamespace("urn:ietf:params:xml:ns:carddav", "C");
+    writer.writeStartElement("urn:ietf:params:xml:ns:carddav", "addressbook-multiget");
+    writer.writeStartElement("DAV:", "prop");
+    writer.writeEmptyElement("DAV:", "getetag");
+    writer.writeEmptyElement("urn:ietf:params:xml:ns:carddav", "address-data");
+    writer.writeEndElement();
+    while (!multigetQueue.isEmpty() && mg->indices.count()<CARDDAV_MULTIGET_BATCH) {
+        int index = multigetQueue.takeFirst();
+        mg->indices << index;
+        writer.writeTextElement("DAV:", "href",
+            QString::fromLatin1(QUrl::toPercentEncoding(w.rootPath() + entries[index].path, "/")));
+    }
+    writer.writeEndElement();
+    writer.writeEndDocument();
+    QNetworkReply* reply = sendDavRequest("REPORT", "/", "1", body);
+    activeMultigets[reply] = mg;
+    connect(reply, SIGNAL(readyRead()), this, SLOT(multigetReadyRead()));
+    connect(reply, SIGNAL(finished()), this, SLOT(multigetFinished()));
+}
+
+void CardDAVFormat::parseMultiget(CardDAVMultiget *mg)
+{
+    // Reader stops with PrematureEndOfDocumentError at end of arrived data
+    // and continues after next addData()
+    QXmlStreamReader& xml = mg->xml;
+    while (!xml.atEnd()) {
+        xml.readNext();
+        if (xml.isStartElement()) {
+            if (xml.namespaceUri()==QLatin1String("DAV:") && xml.name()==QLatin1String("response")) {
+                mg->href.clear();
+                mg->status.clear();
+                mg->etag.clear();
+                mg->addressData.clear();
+            }
+            mg->text.clear();
+        }
+        else if (xml.isCharacters())
+            mg->text += xml.text();
+        else if (xml.isEndElement()) {
+            if (xml.name()==QLatin1String("address-data"))
+                mg->addressData = mg->text;
+            else if (xml.namespaceUri()!=QLatin1String("DAV:"))
+                continue;
+            else if (xml.name()==QLatin1String("href"))
+                mg->href = mg->text;
+            else if (xml.name()==QLatin1String("status") && mg->status.isEmpty())
+                mg->status = mg->text.trimmed();
+            else if (xml.name()==QLatin1String("getetag"))
+                mg->etag = mg->text.trimmed();
+            else if (xml.name()==QLatin1String("response")) {
+                int index = entryIndexes.value(relativePath(mg->href), -1);
+                if (index==-1 || !mg->indices.contains(index) || mg->received.contains(index))
+                    continue;
+                mg->received << index;
+                if (mg->addressData.isEmpty()) {
+                    _errors << tr("Can't read %1: %2").arg(entries[index].path).arg(mg->status);
+                    fetchFailed = true;
+                }
+                else if (!mg->etag.isEmpty())
+                    entries[index].etag = mg->etag;
+                fetchItemDone(index, mg->addressData);
+            }
+        }
+    }
+}
+
+void CardDAVFormat::fetchItemDone(int index, const QString &content)
+{
+    // Failed vCard keeps cached content, but not ETag, to be read next time
+    if (content.isEmpty())
+        entries[index].etag.clear();
+    else {
+        QStringList lines = content.split("\n");
+        entries[index].items.clear();
+        VCardData::importRecords(lines, entries[index].items, true, _errors);
+    }
+    emit progress(tr("Reading"), ++doneFetch, fetchTotal);
+}
+
+void CardDAVFormat::finishFetch()
+{
+    if (cacheChanged || fetchTotal>0 || syncToken!=cachedSyncToken)
+        saveCache();
+    // Merge keeps server order
+    if (readingList)
+        for (int i=0; i<entries.count(); i++) {
+            if (entries[i].deleted)
+                continue;
+            for (int j=0; j<entries[i].items.count(); j++) {
+                entries[i].items[j].fileName = entries[i].path;
+                readingList->appendSwapped(entries[i].items[j]);
+            }
+        }
+    endSession(true);
+}
+
+void CardDAVFormat::requestFailed(QNetworkReply *reply)
+{
+    // Certificate is confirmed out of network signal handler
+    if (state==StateSSLRequest) {
+        QMetaObject::invokeMethod(this, "confirmCertificate", Qt::QueuedConnection);
+        return;
+    }
+    onError(reply->errorString());
+    endSession(false);
+}
+
 void CardDAVFormat::processSslCertifcate(const QList<QSslError> &errors)
 {
     if (!errors.isEmpty()) {
@@ -154,52 +593,438 @@ void CardDAVFormat::onError(QString s)
         _fatalError = s;
 }
 
-void CardDAVFormat::onFinish()
+void CardDAVFormat::propfindFinished()
 {
-    if (state==StateSSLRequest)
+    QNetworkReply* reply = qobject_cast<QNetworkReply*>(QObject::sender());
+    if (!reply)
         return;
-    else
-    if (state!=StateError) {
-        QList<QWebdavItem> list = p.getList();
-        if (list.isEmpty())
-            _fatalError = tr("No DAV items. It seems that this is not a CardDAV server.") + S_CHECK_CONN;
-        else {
-            QWebdavItem item;
-            foreach(item, list)
-                if (item.name().contains(".vcf")) {
-                    // _errors << "Vcard item: " << item.name();
-                    QNetworkReply *reply = w.get(item.path());
-                    connect(reply, SIGNAL(finished()), this, SLOT(replyFinished()));
-                    while (!reply->isFinished())
-                        qApp->processEvents();
-                }
-                else
-                _errors << tr("Strange vCard item: ") << item.name();
-            // TODO
+    // QWebdav deletes only request data, not replies
+    reply->deleteLater();
+    if (reply->error()!=QNetworkReply::NoError) {
+        requestFailed(reply);
+        return;
+    }
+    QList<CardDAVResponse> responses;
+    bool truncated;
+    parseMultistatus(reply->readAll(), responses, truncated);
+    if (responses.isEmpty() && operation==ReadBook) {
+        _fatalError = tr("No DAV items. It seems that this is not a CardDAV server.") + S_CHECK_CONN;
+        endSession(false);
+        return;
+    }
+    // vCards with unchanged ETag are taken from cache
+    QHash<QString, int> cachedIndexes;
+    for (int i=0; i<cachedEntries.count(); i++)
+        cachedIndexes[cachedEntries[i].path] = i;
+    entries.clear();
+    entryIndexes.clear();
+    foreach (const CardDAVResponse& resp, responses) {
+        if (resp.isCollection)
+            continue;
+        if (!resp.path.contains(".vcf")) {
+            _errors << tr("Strange vCard item: ") << resp.path;
+            continue;
         }
+        CardDAVEntry entry;
+        entry.path = resp.path;
+        entry.etag = resp.etag;
+        int cached = cachedIndexes.value(resp.path, -1);
+        entryIndexes[entry.path] = entries.count();
+        if (cached!=-1 && !resp.etag.isEmpty() && cachedEntries[cached].etag==resp.etag)
+            entry.items = cachedEntries[cached].items;
+        else
+            multigetQueue << entries.count();
+        entries << entry;
     }
-    state = StateOff;
+    cacheChanged = (entries.count()!=cachedEntries.count());
+    state = StateTransfer;
+    if (operation==WriteBook) {
+        startUpload();
+        return;
+    }
+    fetchTotal = multigetQueue.count();
+    emit progress(tr("Reading"), 0, fetchTotal);
+    startFetch();
 }
 
-void CardDAVFormat::replyFinished()
+void CardDAVFormat::syncFinished()
 {
     QNetworkReply* reply = qobject_cast<QNetworkReply*>(QObject::sender());
-    if (reply) {
-        QByteArray ba = reply->readAll();
-        QStringList tags = QString::fromLocal8Bit(ba).split("\n");
-        if (readingList)
-            VCardData::importRecords(tags, *readingList, true, _errors);
+    if (!reply)
+        return;
+    reply->deleteLater();
+    int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    if (status!=207) {
+        // Token is expired (403, 409) or sync-collection isn't supported (400, 405, 501)
+        if (status==400 || status==403 || status==405 || status==409
+                || status==412 || status==415 || status==422 || status==501) {
+            cachedSyncToken.clear();
+            startListing();
+        }
+        else
+            requestFailed(reply);
+        return;
+    }
+    QList<CardDAVResponse> responses;
+    bool truncated;
+    parseMultistatus(reply->readAll(), responses, truncated);
+    // Changed and new vCards are downloaded, deleted ones are dropped
+    foreach (const CardDAVResponse& resp, responses) {
+        if (resp.isCollection || !resp.path.contains(".vcf"))
+            continue;
+        int index = entryIndexes.value(resp.path, -1);
+        if (resp.status==404) {
+            if (index!=-1 && !entries[index].deleted) {
+                entries[index].deleted = true;
+                cacheChanged = true;
+            }
+            continue;
+        }
+        if (index==-1) {
+            CardDAVEntry entry;
+            entry.path = resp.path;
+            index = entries.count();
+            entryIndexes[entry.path] = index;
+            entries << entry;
+        }
+        else if (!resp.etag.isEmpty() && entries[index].etag==resp.etag && !entries[index].deleted)
+            continue;
+        entries[index].etag = resp.etag;
+        entries[index].deleted = false;
+        multigetQueue << index;
+    }
+    // Server returns changes by parts; next part is requested by new token
+    if (truncated) {
+        sendSyncReport();
+        return;
     }
+    // vCard can be changed in several parts
+    QList<int> queue;
+    QSet<int> queued;
+    foreach (int index, multigetQueue)
+        if (!queued.contains(index)) {
+            queued << index;
+            queue << index;
+        }
+    multigetQueue = queue;
+    fetchTotal = multigetQueue.count();
+    state = StateTransfer;
+    emit progress(tr("Reading"), 0, fetchTotal);
+    startFetch();
 }
 
-void CardDAVFormat::writeFinished()
+void CardDAVFormat::fetchFinished()
 {
     QNetworkReply* reply = qobject_cast<QNetworkReply*>(QObject::sender());
-    if (reply) {
-        QByteArray ba = reply->readAll();
-        qDebug() << "Wr " << ba;
+    if (!reply || !activeReplies.contains(reply))
+        return;
+    int index = activeReplies.take(reply);
+    reply->deleteLater();
+    if (reply->error()!=QNetworkReply::NoError) {
+        _errors << tr("Can't read %1: %2").arg(entries[index].path).arg(reply->errorString());
+        fetchFailed = true;
+        fetchItemDone(index, QString());
+    }
+    else {
+        if (reply->hasRawHeader("ETag"))
+            entries[index].etag = QString::fromLatin1(reply->rawHeader("ETag"));
+        // CardDAV vCards are UTF-8, as in multiget response (RFC 6352)
+        fetchItemDone(index, QString::fromUtf8(reply->readAll()));
     }
+    startFetch();
 }
+
+void CardDAVFormat::multigetReadyRead()
+{
+    QNetworkReply* reply = qobject_cast<QNetworkReply*>(QObject::sender());
+    CardDAVMultiget* mg = activeMultigets.value(reply, 0);
+    // Non-multistatus reply is analyzed when finished
+    if (!mg || reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt()!=207)
+        return;
+    mg->xml.addData(reply->readAll());
+    parseMultiget(mg);
+}
+
+void CardDAVFormat::multigetFinished()
+{
+    QNetworkReply* reply = qobject_cast<QNetworkReply*>(QObject::sender());
+    if (!reply || !activeMultigets.contains(reply))
+        return;
+    CardDAVMultiget* mg = activeMultigets.take(reply);
+    reply->deleteLater();
+    if (reply->error()==QNetworkReply::NoError
+            && reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt()==207) {
+        mg->xml.addData(reply->readAll());
+        parseMultiget(mg);
+    }
+    else {
+        // REPORT isn't supported; rest of vCards are read one by one
+        getQueue << multigetQueue;
+        multigetQueue.clear();
+    }
+    // vCards, missing in response, are also requested separately
+    foreach (int index, mg->indices)
+        if (!mg->received.contains(index))
+            getQueue << index;
+    delete mg;
+    startFetch();
+}
+
+QString CardDAVFormat::newPath(ContactItem &item, const QSet<QString> &claimed)
+{
+    // Resource is named by UID; contact without UID gets new one (RFC 6352 requires it)
+    QString name;
+    if (item.idType=="UID")
+        foreach (const QChar& c, item.id) {
+            if ((c.isLetterOrNumber() && c.unicode()<128) || c=='.' || c=='_' || c=='@' || c=='-')
+                name += c;
+            else
+                name += '_';
+        }
+    if (name.isEmpty() || name.startsWith('.') || claimed.contains("/" + name + ".vcf")) {
+        name = QUuid::createUuid().toString();
+        name.remove("{");
+        name.remove("}");
+        item.id = name;
+        item.idType = "UID";
+    }
+    return "/" + name + ".vcf";
+}
+
+void CardDAVFormat::startUpload()
+{
+    // Server state of previous import is base for conditional requests
+    QHash<QString, int> cachedIndexes;
+    for (int i=0; i<cachedEntries.count(); i++)
+        cachedIndexes[cachedEntries[i].path] = i;
+    // Resource paths are known only for contacts of this addressbook
+    bool sameBook = (writingList->originalPath==_url);
+    QSet<QString> claimed;
+    uploads.clear();
+    uploadQueue.clear();
+    for (int i=0; i<writingList->count(); i++) {
+        ContactItem& item = (*writingList)[i];
+        QString path = sameBook ? item.fileName : QString();
+        bool known = !path.isEmpty() && !claimed.contains(path);
+        if (!known)
+            path = newPath(item, claimed);
+        claimed << path;
+        int onServer = entryIndexes.value(path, -1);
+        if (known && !item.modified && onServer!=-1)
+            continue;
+        CardDAVUpload up;
+        up.method = "PUT";
+        up.path = path;
+        up.index = i;
+        // Contact changed on server by other client isn't overwritten
+        if (onServer!=-1) {
+            int cached = cachedIndexes.value(path, -1);
+            up.ifMatch = (cached!=-1 && !cachedEntries[cached].etag.isEmpty())
+                ? cachedEntries[cached].etag : entries[onServer].etag;
+        }
+        else
+            up.ifNoneMatch = true;
+        uploads << up;
+    }
+    // Deleted contacts of this addressbook
+    if (sameBook)
+        foreach (const QString& path, writingList->removedFiles) {
+            int onServer = entryIndexes.value(path, -1);
+            if (claimed.contains(path) || onServer==-1)
+                continue;
+            claimed << path;
+            CardDAVUpload up;
+            up.method = "DELETE";
+            up.path = path;
+            int cached = cachedIndexes.value(path, -1);
+            up.ifMatch = (cached!=-1 && !cachedEntries[cached].etag.isEmpty())
+                ? cachedEntries[cached].etag : entries[onServer].etag;
+            uploads << up;
+        }
+    for (int i=0; i<uploads.count(); i++)
+        uploadQueue << i;
+    uploadTotal = uploads.count();
+    doneUpload = 0;
+    pendingRetries = 0;
+    emit progress(tr("Writing"), 0, uploadTotal);
+    startUploads();
+}
+
+void CardDAVFormat::startUploads()
+{
+    while (activeUploads.count()<maxRequests && !uploadQueue.isEmpty()) {
+        int n = uploadQueue.takeFirst();
+        const CardDAVUpload& up = uploads[n];
+        QNetworkRequest req = davRequest(up.path);
+        if (!up.ifMatch.isEmpty())
+            req.setRawHeader("If-Match", up.ifMatch.toLatin1());
+        if (up.ifNoneMatch)
+            req.setRawHeader("If-None-Match", "*");
+        QNetworkReply* reply;
+        if (up.method=="PUT") {
+            QStringList lines;
+            QStringList errors;
+            exportRecord(lines, (*writingList)[up.index], errors);
+            // Data loss is reported once, not on each retry
+            if (up.attempt==0)
+                _errors << errors;
+            req.setHeader(QNetworkRequest::ContentTypeHeader, "text/vcard; charset=utf-8");
+            reply = w.QNetworkAccessManager::put(req, (lines.join("\r\n") + "\r\n").toUtf8());
+        }
+        else
+            reply = w.QNetworkAccessManager::deleteResource(req);
+        activeUploads[reply] = n;
+        connect(reply, SIGNAL(finished()), this, SLOT(uploadFinished()));
+    }
+    if (activeUploads.isEmpty() && uploadQueue.isEmpty() && pendingRetries==0)
+        finishUpload();
+}
+
+void CardDAVFormat::finishUpload()
+{
+    // Written contacts become contacts of this addressbook
+    bool sameBook = (writingList->originalPath==_url);
+    bool allWritten = true;
+    QHash<QString, int> uploadIndexes;
+    for (int i=0; i<uploads.count(); i++) {
+        uploadIndexes[uploads[i].path] = i;
+        if (!uploads[i].done)
+            allWritten = false;
+    }
+    // After partial write to other addressbook, list still belongs to its
+    // source (i.e. VCF directory), so its file names are kept
+    if (sameBook || allWritten) {
+        foreach (const CardDAVUpload& up, uploads) {
+            if (!up.done)
+                continue;
+            if (up.method=="PUT") {
+                ContactItem& item = (*writingList)[up.index];
+                item.fileName = up.path;
+                item.modified = false;
+            }
+            else
+                writingList->removedFiles.removeAll(up.path);
+        }
+        writingList->originalPath = _url;
+    }
+    // Cache reflects written state; without sync-token, next import
+    // checks it by ETags
+    QList<CardDAVEntry> written;
+    QSet<QString> listed;
+    foreach (const CardDAVUpload& up, uploads) {
+        if (!up.done || up.method!="PUT" || listed.contains(up.path))
+            continue;
+        CardDAVEntry entry;
+        entry.path = up.path;
+        entry.etag = up.etag;
+        entry.items << (*writingList)[up.index];
+        listed << entry.path;
+        written << entry;
+    }
+    // Unchanged contacts of this addressbook
+    if (writingList->originalPath==_url)
+        foreach (const ContactItem& item, *writingList) {
+            if (item.fileName.isEmpty() || listed.contains(item.fileName)
+                || uploadIndexes.contains(item.fileName))
+                continue;
+            int onServer = entryIndexes.value(item.fileName, -1);
+            if (onServer==-1)
+                continue;
+            CardDAVEntry entry;
+            entry.path = item.fileName;
+            entry.etag = entries[onServer].etag;
+            entry.items << item;
+            listed << entry.path;
+            written << entry;
+        }
+    // Other contacts of addressbook, if they are cached
+    for (int i=0; i<entries.count(); i++) {
+        if (listed.contains(entries[i].path) || entries[i].items.isEmpty())
+            continue;
+        int n = uploadIndexes.value(entries[i].path, -1);
+        if (n!=-1 && (uploads[n].done || uploads[n].method=="DELETE"))
+            continue;
+        written << entries[i];
+    }
+    entries = written;
+    syncToken.clear();
+    fetchFailed = false;
+    saveCache();
+    endSession(true);
+}
+
+void CardDAVFormat::uploadFinished()
+{
+    QNetworkReply* reply = qobject_cast<QNetworkReply*>(QObject::sender());
+    if (!reply || !activeUploads.contains(reply))
+        return;
+    int n = activeUploads.take(reply);
+    reply->deleteLater();
+    CardDAVUpload& up = uploads[n];
+    int status = reply->attribute(QNetworkRequest::HttpStatusCodeAttribute).toInt();
+    QNetworkReply::NetworkError err = reply->error();
+    if (err==QNetworkReply::NoError || (up.method=="DELETE" && status==404)) {
+        // ETag is returned only if server stored vCard as is
+        up.etag = QString::fromLatin1(reply->rawHeader("ETag"));
+        up.done = true;
+        emit progress(tr("Writing"), ++doneUpload, uploadTotal);
+    }
+    else if (status==412) {
+        _errors << tr("%1 was changed on server by other client, and it isn't overwritten").arg(up.path);
+        emit progress(tr("Writing"), ++doneUpload, uploadTotal);
+    }
+    else if (up.attempt<CARDDAV_MAX_RETRIES &&
+             (status==408 || status==429 || status==500 || status==502 || status==503 || status==504
+              || (status==0 && (err==QNetworkReply::RemoteHostClosedError || err==QNetworkReply::TimeoutError
+                  || err==QNetworkReply::TemporaryNetworkFailureError || err==QNetworkReply::UnknownNetworkError)))) {
+        // Temporary failure; delay is doubled on each attempt or is set by server
+        int delay = CARDDAV_RETRY_DELAY << up.attempt;
+        if (reply->hasRawHeader("Retry-After")) {
+            bool ok;
+            int secs = reply->rawHeader("Retry-After").trimmed().toInt(&ok);
+            // Clamped before conversion to msecs, to avoid overflow
+            if (ok && secs>=0)
+                delay = qMin(secs, CARDDAV_MAX_RETRY_DELAY/1000)*1000;
+        }
+        up.attempt++;
+        up.retryAt = QDateTime::currentMSecsSinceEpoch() + delay;
+        retryQueue << n;
+        pendingRetries++;
+        QTimer::singleShot(delay, this, SLOT(retryUpload()));
+    }
+    else {
+        _errors << tr("Can't write %1: %2").arg(up.path).arg(reply->errorString());
+        emit progress(tr("Writing"), ++doneUpload, uploadTotal);
+    }
+    startUploads();
+}
+
+void CardDAVFormat::retryUpload()
+{
+    // Timer repeats only requests whose time has come, whichever request armed it
+    qint64 now = QDateTime::currentMSecsSinceEpoch();
+    qint64 next = -1;
+    bool moved = false;
+    for (int i=0; i<retryQueue.count(); i++) {
+        int n = retryQueue[i];
+        if (uploads[n].retryAt<=now) {
+            uploadQueue << n;
+            retryQueue.removeAt(i--);
+            pendingRetries--;
+            moved = true;
+        }
+        else if (next==-1 || uploads[n].retryAt<next)
+            next = uploads[n].retryAt;
+    }
+    // Timer can fire a bit early; then it is armed again for nearest request
+    if (!moved) {
+        if (next!=-1)
+            QTimer::singleShot((int)qMax<qint64>(next-now, 1), this, SLOT(retryUpload()));
+        return;
+    }
+    startUploads();
+}
+
 /*
 void CardDAVFormat::urlReqFinished()
 {
@@ -11,10 +11,14 @@
  *
  */
 
+#include <QHash>
+#include <QNetworkRequest>
+#include <QSet>
 #include <QStringList>
+#include <QUrl>
+#include <QXmlStreamReader>
 
 #include "asyncformat.h"
-#include "qwebdavdirparser.h"
 #include "qwebdav.h"
 #include "../common/vcarddata.h"
 
@@ -24,29 +28,144 @@
 # define PATH_CARDDAV_OWNCLOUD QString("/remote.php/carddav/addressbooks/%1/contacts")
 # define PATH_CARDDAV_NEXTCLOUD QString("/nextcloud/remote.php/dav/addressbooks/users/%1/contacts")
 
+// Default count of simultaneous requests (QNetworkAccessManager opens up to 6 connections per host)
+#define CARDDAV_MAX_REQUESTS 6
+// vCards per one addressbook-multiget REPORT
+#define CARDDAV_MULTIGET_BATCH 200
+
+// Temporary failed write request is repeated
+#define CARDDAV_MAX_RETRIES 4
+#define CARDDAV_RETRY_DELAY 500
+#define CARDDAV_MAX_RETRY_DELAY 30000
+
+// Local copy of addressbook, to download only changed vCards on next import
+#define CARDDAV_CACHE_MAGIC 0x44434344
+#define CARDDAV_CACHE_VERSION 2
+
+// One vCard resource of addressbook
+struct CardDAVEntry
+{
+    QString path; // relative to addressbook path
+    QString etag;
+    ContactList items;
+    bool deleted; // by sync-collection report
+    CardDAVEntry();
+};
+
+// One response of multistatus reply to PROPFIND or sync-collection REPORT
+struct CardDAVResponse
+{
+    QString path;
+    int status; // of response or of its successful propstat
+    QString etag;
+    bool isCollection;
+};
+
+// One addressbook-multiget REPORT (RFC 6352), parsed while response arrives
+struct CardDAVMultiget
+{
+    QList<int> indices; // in entry list
+    QXmlStreamReader xml;
+    QString href, status, etag, addressData;
+    QString text; // current element content, can arrive by parts
+    QList<int> received;
+};
+
+// One write request: PUT of new or changed contact or DELETE of removed one
+struct CardDAVUpload
+{
+    QByteArray method;
+    QString path;
+    int index; // in written list, for PUT
+    QString ifMatch; // ETag of known version
+    bool ifNoneMatch; // for new contact
+    int attempt;
+    qint64 retryAt; // msecs since epoch
+    bool done;
+    QString etag; // of written version
+    CardDAVUpload();
+};
+
 class CardDAVFormat : public AsyncFormat, VCardData
 {
     Q_OBJECT
 public:
     explicit CardDAVFormat();
-    virtual bool importRecords(const QString& url, ContactList& list, bool append);
-    virtual bool exportRecords(const QString& url, ContactList& list);
+    virtual bool startImport(const QString& url, ContactList& list, bool append);
+    virtual bool startExport(const QString& url, ContactList& list);
     QNetworkAccessManager* netManager();
+    void setMaxRequests(int count);
 private:
     QWebdav w;
-    QWebdavDirParser p;
+    QUrl u;
+    int port;
+    QString userName, password;
     QString host; // for valid error messages
     // Certificate details
     QStringList sslMessages;
     QString digMd5, digSha1;
+    enum Operation {
+        ReadBook,
+        WriteBook
+    } operation;
     // Reading data
     ContactList* readingList;
+    bool readingListWasEmpty;
+    ContactList* writingList;
+    int maxRequests;
+    // Addressbook state: cached on previous import and actual
+    QString cachePath;
+    QString cachedSyncToken, syncToken;
+    QList<CardDAVEntry> cachedEntries;
+    QList<CardDAVEntry> entries;
+    QHash<QString, int> entryIndexes; // by path
+    bool cacheChanged, fetchFailed;
+    // Download of new and changed vCards
+    QHash<QNetworkReply*, int> activeReplies;
+    QHash<QNetworkReply*, CardDAVMultiget*> activeMultigets;
+    QList<int> multigetQueue, getQueue;
+    int fetchTotal, doneFetch;
+    // Writing of changed and removed contacts
+    QList<CardDAVUpload> uploads;
+    QList<int> uploadQueue, retryQueue;
+    QHash<QNetworkReply*, int> activeUploads;
+    int pendingRetries, uploadTotal, doneUpload;
+    bool openSession(const QString& url);
+    void startSession();
+    void endSession(bool success);
+    void closeSession();
+    QNetworkRequest davRequest(const QString& path);
+    QNetworkReply* sendDavRequest(const QByteArray& method, const QString& path,
+        const QByteArray& depth, const QByteArray& body);
+    QString relativePath(const QString& href);
+    static int statusCode(const QString& status);
+    void parseMultistatus(const QByteArray& data, QList<CardDAVResponse>& responses, bool& truncated);
+    void loadCache();
+    void saveCache();
+    void startListing();
+    void sendSyncReport();
+    void startFetch();
+    void startMultiget();
+    void parseMultiget(CardDAVMultiget* mg);
+    void fetchItemDone(int index, const QString& content);
+    void finishFetch();
+    void requestFailed(QNetworkReply* reply);
+    QString newPath(ContactItem& item, const QSet<QString>& claimed);
+    void startUpload();
+    void startUploads();
+    void finishUpload();
+private slots:
+    void confirmCertificate();
 public slots:
     void processSslCertifcate(const QList<QSslError> &errors);
     void onError(QString s);
-    void onFinish();
-    void replyFinished();
-    void writeFinished();
+    void propfindFinished();
+    void syncFinished();
+    void fetchFinished();
+    void multigetReadyRead();
+    void multigetFinished();
+    void uploadFinished();
+    void retryUpload();
     //void urlReqFinished();
     //void urlReqError(QNetworkReply::NetworkError code);
 };
@@ -10,9 +10,297 @@
  * (at your option) any later version. See COPYING file for more details.
  *
  */
+#include <QCryptographicHash>
+#include <QDir>
+#include <QEventLoop>
+#include <QFile>
+#include <QNetworkRequest>
+#include <QTimer>
+#include <QUrl>
+
+#include "asyncformat.h"
 #include "imageloader.h"
 
-ImageLoader::ImageLoader(QObject *parent) : QObject(parent)
+// Cache is optional, so write errors are ignored
+static void writeCacheFile(const QString& path, const QByteArray& data)
+{
+    QFile f(path + ".new");
+    if (!f.open(QIODevice::WriteOnly))
+        return;
+    if (f.write(data)!=data.size()) {
+        f.close();
+        f.remove();
+        return;
+    }
+    f.close();
+    QFile::remove(path);
+    QFile::rename(path + ".new", path);
+}
+
+ImageLoader::ImageLoader(QObject *parent)
+    : QObject(parent), list(0), maxRequests(IMAGELOADER_MAX_REQUESTS),
+      _cachePath(AsyncFormat::cacheDir() + QDir::separator() + "images"),
+      scheduled(false), total(0), done(0), loaded(0), failed(0)
+{
+}
+
+void ImageLoader::loadImages(ContactList &list)
+{
+    if (this->list!=&list) {
+        cancel();
+        this->list = &list;
+        _errors.clear();
+        total = done = loaded = failed = 0;
+    }
+    for (int i=0; i<list.count(); i++) {
+        const Photo& photo = list[i].photo;
+        if (photo.pType!="URL" || photo.url.trimmed().isEmpty())
+            continue;
+        QString url = photo.url.trimmed();
+        // Each URL is requested once
+        if (!waiting.contains(url)) {
+            queue << url;
+            total++;
+        }
+        waiting[url] << i;
+    }
+    schedule();
+}
+
+void ImageLoader::cancel()
 {
+    if (!list)
+        return;
+    foreach (QNetworkReply* reply, activeUrls.keys()) {
+        disconnect(reply, 0, this, 0);
+        reply->abort();
+        reply->deleteLater();
+    }
+    failed += activeUrls.count() + queue.count() + netQueue.count();
+    activeUrls.clear();
+    activeRedirects.clear();
+    queue.clear();
+    netQueue.clear();
+    waiting.clear();
+    list = 0;
+    emit finished(false);
+}
+
+bool ImageLoader::isRunning() const
+{
+    return list!=0;
+}
+
+bool ImageLoader::waitForFinished()
+{
+    if (isRunning()) {
+        QEventLoop loop;
+        connect(this, SIGNAL(finished(bool)), &loop, SLOT(quit()));
+        loop.exec();
+    }
+    return failed==0;
+}
+
+void ImageLoader::setMaxRequests(int count)
+{
+    maxRequests = qMax(count, 1);
+}
+
+void ImageLoader::setCachePath(const QString &path)
+{
+    _cachePath = path;
+}
+
+QString ImageLoader::cachePath() const
+{
+    return _cachePath;
+}
+
+QNetworkAccessManager *ImageLoader::netManager()
+{
+    return &nam;
+}
+
+QStringList ImageLoader::errors() const
+{
+    return _errors;
+}
+
+int ImageLoader::loadedCount() const
+{
+    return loaded;
+}
 
+int ImageLoader::failedCount() const
+{
+    return failed;
+}
+
+void ImageLoader::schedule()
+{
+    if (scheduled)
+        return;
+    scheduled = true;
+    QTimer::singleShot(0, this, SLOT(processQueue()));
+}
+
+void ImageLoader::processQueue()
+{
+    scheduled = false;
+    if (!list)
+        return;
+    // Cached images are applied by parts
+    int checked = 0;
+    while (!queue.isEmpty() && checked<IMAGELOADER_CACHE_BATCH) {
+        QString url = queue.takeFirst();
+        checked++;
+        QByteArray data;
+        if (readCache(url, data) && applyImage(url, data))
+            urlDone();
+        else
+            netQueue << url;
+    }
+    while (!netQueue.isEmpty() && activeUrls.count()<maxRequests) {
+        QString url = netQueue.takeFirst();
+        QUrl location(url);
+        QString scheme = location.scheme().toLower();
+        if (!location.isValid() || (scheme!="http" && scheme!="https")) {
+            urlFailed(url, tr("Invalid URL"));
+            urlDone();
+            continue;
+        }
+        sendRequest(url, location, 0);
+    }
+    if (!queue.isEmpty())
+        schedule();
+    checkFinished();
+}
+
+void ImageLoader::sendRequest(const QString &url, const QUrl &location, int redirects)
+{
+    QNetworkRequest request(location);
+#if QT_VERSION >= 0x050000
+    request.setAttribute(QNetworkRequest::HttpPipeliningAllowedAttribute, true);
+#endif
+    QNetworkReply* reply = nam.get(request);
+    activeUrls[reply] = url;
+    activeRedirects[reply] = redirects;
+    connect(reply, SIGNAL(finished()), this, SLOT(replyFinished()));
+}
+
+void ImageLoader::replyFinished()
+{
+    QNetworkReply* reply = qobject_cast<QNetworkReply*>(QObject::sender());
+    if (!reply || !activeUrls.contains(reply))
+        return;
+    reply->deleteLater();
+    QString url = activeUrls.take(reply);
+    int redirects = activeRedirects.take(reply);
+    QUrl target = reply->attribute(QNetworkRequest::RedirectionTargetAttribute).toUrl();
+    if (reply->error()!=QNetworkReply::NoError)
+        urlFailed(url, reply->errorString());
+    else if (target.isValid()) {
+        if (redirects<IMAGELOADER_MAX_REDIRECTS) {
+            sendRequest(url, reply->url().resolved(target), redirects+1);
+            return;
+        }
+        urlFailed(url, tr("Too many redirects"));
+    }
+    else {
+        QByteArray data = reply->readAll();
+        if (data.isEmpty())
+            urlFailed(url, tr("Empty response"));
+        else if (!applyImage(url, data))
+            urlFailed(url, tr("Unsupported image format"));
+        else
+            writeCache(url, data);
+    }
+    urlDone();
+    processQueue();
+}
+
+bool ImageLoader::applyImage(const QString &url, const QByteArray &data)
+{
+    Photo image;
+    image.data = data;
+    QString format = image.detectFormat();
+    if (format=="UNKNOWN")
+        return false;
+    foreach (int i, waiting.take(url)) {
+        // Contact can be edited while image was loaded
+        if (i>=list->count())
+            continue;
+        Photo& photo = (*list)[i].photo;
+        if (photo.pType!="URL" || photo.url.trimmed()!=url)
+            continue;
+        photo.pType = format;
+        photo.data = data;
+        // Incremental writers (CardDAV, VCF directory) save only modified contacts
+        (*list)[i].modified = true;
+        if (list->photoURLCount>0)
+            list->photoURLCount--;
+        emit imageLoaded(i);
+    }
+    loaded++;
+    return true;
+}
+
+void ImageLoader::urlFailed(const QString &url, const QString &error)
+{
+    waiting.remove(url);
+    failed++;
+    _errors << tr("Can't load photo %1: %2").arg(url).arg(error);
+}
+
+void ImageLoader::urlDone()
+{
+    done++;
+    emit progress(done, total);
+}
+
+void ImageLoader::checkFinished()
+{
+    if (!list || !queue.isEmpty() || !netQueue.isEmpty() || !activeUrls.isEmpty())
+        return;
+    list = 0;
+    emit finished(failed==0);
+}
+
+QString ImageLoader::urlKey(const QString &url) const
+{
+    return QString::fromLatin1(
+        QCryptographicHash::hash(url.toUtf8(), QCryptographicHash::Sha1).toHex());
+}
+
+bool ImageLoader::readCache(const QString &url, QByteArray &data)
+{
+    if (_cachePath.isEmpty())
+        return false;
+    // URL file contains hash of image content
+    QFile ref(_cachePath + QDir::separator() + urlKey(url) + ".url");
+    if (!ref.open(QIODevice::ReadOnly))
+        return false;
+    QByteArray hash = ref.readAll().trimmed();
+    ref.close();
+    if (hash.isEmpty())
+        return false;
+    QFile img(_cachePath + QDir::separator() + QString::fromLatin1(hash) + ".img");
+    if (!img.open(QIODevice::ReadOnly))
+        return false;
+    data = img.readAll();
+    img.close();
+    // Damaged image is loaded again
+    return QCryptographicHash::hash(data, QCryptographicHash::Sha1).toHex()==hash;
+}
+
+void ImageLoader::writeCache(const QString &url, const QByteArray &data)
+{
+    if (_cachePath.isEmpty() || !QDir().mkpath(_cachePath))
+        return;
+    QByteArray hash = QCryptographicHash::hash(data, QCryptographicHash::Sha1).toHex();
+    QString imgPath = _cachePath + QDir::separator() + QString::fromLatin1(hash) + ".img";
+    // Same image under other URL is already stored
+    if (!QFile::exists(imgPath))
+        writeCacheFile(imgPath, data);
+    writeCacheFile(_cachePath + QDir::separator() + urlKey(url) + ".url", hash);
 }
@@ -13,16 +13,77 @@
 #ifndef IMAGELOADER_H
 #define IMAGELOADER_H
 
+#include <QHash>
+#include <QList>
+#include <QNetworkAccessManager>
+#include <QNetworkReply>
 #include <QObject>
+#include <QStringList>
+
+#include "contactlist.h"
+
+// Default count of simultaneous downloads
+#define IMAGELOADER_MAX_REQUESTS 6
+// Cached images applied per one event loop pass, to keep UI responsive
+#define IMAGELOADER_CACHE_BATCH 32
+// Short URLs (Google) are redirected to image itself
+#define IMAGELOADER_MAX_REDIRECTS 5
+
+// Loads photos given by URL (PHOTO;VALUE=URI and Google short URLs)
+// into Photo::data in background. Each URL is downloaded once, even if
+// it's used by many contacts. Images are kept on disk, in files named
+// by content hash, and URLs refer to them, so same image is stored once
 class ImageLoader : public QObject
 {
     Q_OBJECT
 public:
     explicit ImageLoader(QObject *parent = 0);
-
+    // Queue all photo URLs of list; list must not be reordered until finished()
+    void loadImages(ContactList& list);
+    void cancel();
+    bool isRunning() const;
+    // Block in local event loop; return false, if some images weren't loaded
+    bool waitForFinished();
+    void setMaxRequests(int count);
+    // Empty path disables disk cache
+    void setCachePath(const QString& path);
+    QString cachePath() const;
+    QNetworkAccessManager* netManager();
+    QStringList errors() const;
+    int loadedCount() const;
+    int failedCount() const;
 signals:
-
-public slots:
+    void imageLoaded(int index); // in list
+    void progress(int done, int total);
+    void finished(bool success);
+private slots:
+    void processQueue();
+    void replyFinished();
+private:
+    QNetworkAccessManager nam;
+    ContactList* list;
+    int maxRequests;
+    QString _cachePath;
+    QStringList _errors;
+    // Contacts (indices in list) waiting for each URL
+    QHash<QString, QList<int> > waiting;
+    // URLs not checked in cache yet, and URLs waiting for free connection
+    QStringList queue, netQueue;
+    // Original URL and redirect count of each active download
+    QHash<QNetworkReply*, QString> activeUrls;
+    QHash<QNetworkReply*, int> activeRedirects;
+    bool scheduled;
+    int total, done, loaded, failed;
+    void schedule();
+    void sendRequest(const QString& url, const QUrl& location, int redirects);
+    bool applyImage(const QString& url, const QByteArray& data);
+    void urlFailed(const QString& url, const QString& error);
+    void urlDone();
+    void checkFinished();
+    // Disk cache
+    QString urlKey(const QString& url) const;
+    bool readCache(const QString& url, QByteArray& data);
+    void writeCache(const QString& url, const QByteArray& data);
 };
 
 #endif // IMAGELOADER_H
@@ -57,12 +57,12 @@ QStringList CSVProfileBase::makeHeader()
     return QStringList();
 }
 
-bool CSVProfileBase::present(const QStringList &row, int index)
+bool CSVProfileBase::present(const QStringList &row, int index) const
 {
     return row.count()>index && !row[index].isEmpty();
 }
 
-bool CSVProfileBase::condAddPhone(const QStringList &row, ContactItem &item, int index, const QString &phType)
+bool CSVProfileBase::condAddPhone(const QStringList &row, ContactItem &item, int index, const QString &phType) const
 {
     if (row.count()>index && !row[index].isEmpty()) {
         item.phones << Phone(row[index], phType);
@@ -72,7 +72,7 @@ bool CSVProfileBase::condAddPhone(const QStringList &row, ContactItem &item, int
         return false;
 }
 
-bool CSVProfileBase::condReadValue(const QStringList &row, int index, QString &dest)
+bool CSVProfileBase::condReadValue(const QStringList &row, int index, QString &dest) const
 {
     if (row.count()>index && !row[index].isEmpty()) {
         dest = row[index];
@@ -82,7 +82,7 @@ bool CSVProfileBase::condReadValue(const QStringList &row, int index, QString &d
         return false;
 }
 
-bool CSVProfileBase::readWarning(const QStringList &row, int index, QStringList& errors)
+bool CSVProfileBase::readWarning(const QStringList &row, int index, QStringList& errors) const
 {
     if (row.count()>index && !row[index].isEmpty()) {
         errors << QString("Column %1 is not empty (%2). Please, contact author").arg(index).arg(row[index]); // Don't translate!
@@ -92,7 +92,7 @@ bool CSVProfileBase::readWarning(const QStringList &row, int index, QStringList&
         return false;
 }
 
-QString CSVProfileBase::saveNamePart(const ContactItem &item, int nameIndex)
+QString CSVProfileBase::saveNamePart(const ContactItem &item, int nameIndex) const
 {
     if (item.names.count()>nameIndex && !item.names[nameIndex].isEmpty())
         return item.names[nameIndex];
@@ -43,7 +43,8 @@ public:
     LineEnding lineEnding() const;
     // Read
     virtual bool parseHeader(const QStringList& header);
-    virtual bool importRecord(const QStringList& row, ContactItem& item, QStringList& errors)=0;
+    // Must be reentrant: CSVFile calls it from some threads at once
+    virtual bool importRecord(const QStringList& row, ContactItem& item, QStringList& errors) const=0;
     // Write
     virtual bool prepareExport(const ContactList &list);
     virtual QStringList makeHeader();
@@ -55,11 +56,11 @@ protected:
     QuotingPolicy _quotingPolicy;
     LineEnding _lineEnding;
     // Helpers
-    bool present(const QStringList &row, int index);
-    bool condAddPhone(const QStringList &row, ContactItem &item, int index, const QString& phType);
-    bool condReadValue(const QStringList &row, int index, QString& dest);
-    bool readWarning(const QStringList &row, int index, QStringList& errors);
-    QString saveNamePart(const ContactItem &item, int nameIndex);
+    bool present(const QStringList &row, int index) const;
+    bool condAddPhone(const QStringList &row, ContactItem &item, int index, const QString& phType) const;
+    bool condReadValue(const QStringList &row, int index, QString& dest) const;
+    bool readWarning(const QStringList &row, int index, QStringList& errors) const;
+    QString saveNamePart(const ContactItem &item, int nameIndex) const;
 };
 
 // Macros for use exclusively in exportRecord(...) methods
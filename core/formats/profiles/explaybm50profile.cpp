@@ -31,7 +31,7 @@ bool ExplayBM50Profile::detect(const QStringList &header) const
             && header[2]=="Middle name";
 }
 
-bool ExplayBM50Profile::importRecord(const QStringList &row, ContactItem &item, QStringList& errors)
+bool ExplayBM50Profile::importRecord(const QStringList &row, ContactItem &item, QStringList& errors) const
 {
     // TODO not all fields
     if (row.count()<13) {
@@ -55,7 +55,7 @@ bool GenericCSVProfile::parseHeader(const QStringList &header)
     return (!header.isEmpty());
 }
 
-bool GenericCSVProfile::importRecord(const QStringList &row, ContactItem &item, QStringList& errors)
+bool GenericCSVProfile::importRecord(const QStringList &row, ContactItem &item, QStringList& errors) const
 {
     if (row.count()!= _header.count())
         errors << QObject::tr("Row length (%1) is not equal header length (%2). Possibly, incorrect CSV. \n%3")
@@ -66,10 +66,13 @@ bool GenericCSVProfile::importRecord(const QStringList &row, ContactItem &item,
         if (!row[i].isEmpty())
             vCard << _header[i] + ":" + row[i];
     vCard << "END:VCARD";
+    // VCardData keeps per-line decoding state, so local reader for each call
+    VCardData reader;
+    reader.setSkipCoding(true, true);
     ContactList list;
-    bool res = VCardData::importRecords(vCard, list, false, errors);
+    bool res = reader.importRecords(vCard, list, false, errors);
     if (!list.isEmpty())
-        item = list[0];
+        item.swap(list[0]);
     return res;
 
 }
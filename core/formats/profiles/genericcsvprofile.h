@@ -30,7 +30,7 @@ public:
     virtual bool detect(const QStringList& header) const;
     // Read
     virtual bool parseHeader(const QStringList& header);
-    virtual bool importRecord(const QStringList& row, ContactItem& item, QStringList& errors);
+    virtual bool importRecord(const QStringList& row, ContactItem& item, QStringList& errors) const;
     // Write
     virtual QStringList makeHeader();
     virtual bool prepareExport(const ContactList &list);
@@ -42,7 +42,7 @@ bool OsmoProfile::parseHeader(const QStringList &header)
     return !columnIndexes.isEmpty();
 }
 
-bool OsmoProfile::importRecord(const QStringList &row, ContactItem &item, QStringList &errors)
+bool OsmoProfile::importRecord(const QStringList &row, ContactItem &item, QStringList &errors) const
 {
     // TODO m.b. need fatalError
     if (row.count()<4) {
@@ -338,18 +338,18 @@ bool OsmoProfile::exportRecord(QStringList &row, const ContactItem &item, QStrin
     return true;
 }
 
-bool OsmoProfile::present(const QStringList &row, const QString &colName)
+bool OsmoProfile::present(const QStringList &row, const QString &colName) const
 {
     if (columnIndexes.contains(colName))
-        return CSVProfileBase::present(row, columnIndexes[colName]);
+        return CSVProfileBase::present(row, columnIndexes.value(colName));
     else
         return false;
 }
 
-QString OsmoProfile::value(const QStringList &row, const QString &colName)
+QString OsmoProfile::value(const QStringList &row, const QString &colName) const
 {
     if (present(row, colName))
-        return row[columnIndexes[colName]];
+        return row[columnIndexes.value(colName)];
     else
         return "";
 }
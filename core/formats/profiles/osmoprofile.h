@@ -23,15 +23,15 @@ public:
     virtual bool detect(const QStringList &header) const;
     // Read
     virtual bool parseHeader(const QStringList& header);
-    virtual bool importRecord(const QStringList &row, ContactItem &item, QStringList &errors);
+    virtual bool importRecord(const QStringList &row, ContactItem &item, QStringList &errors) const;
     // Write
     virtual QStringList makeHeader();
     virtual bool exportRecord(QStringList &row, const ContactItem &item, QStringList &errors);
 private:
     QMap<QString, int> columnIndexes;
     // Helpers
-    bool present(const QStringList &row, const QString& colName);
-    QString value(const QStringList &row, const QString& colName);
+    bool present(const QStringList &row, const QString& colName) const;
+    QString value(const QStringList &row, const QString& colName) const;
 };
 
 #endif // OSMOPROFILE_H
@@ -15,12 +15,46 @@
 #include <QBrush>
 #include <QFileInfo>
 #include <QMimeData>
+#include <QPair>
 #include <QTextStream>
 
 #include "contactmodel.h"
 #include "formats/common/vcarddata.h"
 #include "formats/files/vcfdirectory.h"
 
+ContactMimeData::ContactMimeData(const ContactList &contacts)
+    :QMimeData(), _contacts(contacts)
+{}
+
+const ContactList &ContactMimeData::contacts() const
+{
+    return _contacts;
+}
+
+QStringList ContactMimeData::formats() const
+{
+    return QStringList() << MIME_TYPE_CONTACTS << MIME_TYPE_VCARD;
+}
+
+QVariant ContactMimeData::retrieveData(const QString &mimeType, QVariant::Type type) const
+{
+    if (mimeType!=MIME_TYPE_VCARD)
+        return QMimeData::retrieveData(mimeType, type);
+    VCardData d;
+    d.setSkipCoding(true, true);
+    QStringList lines, errors;
+    QByteArray encodedData;
+    QTextStream stream(&encodedData, QIODevice::WriteOnly);
+    foreach (const ContactItem& c, _contacts) {
+        lines.clear();
+        d.exportRecord(lines, c, errors);
+        foreach(const QString& s, lines)
+            stream << s << "\n";
+    }
+    stream.flush();
+    return encodedData;
+}
+
 ContactModel::ContactModel(QObject *parent, const QString& source, RecentList& recent) :
     QAbstractTableModel(parent), _source(source), _sourceType(ftNew),
     _changed(false), _viewMode(ContactModel::Standard), _recent(recent)
@@ -30,6 +64,12 @@ ContactModel::ContactModel(QObject *parent, const QString& source, RecentList& r
     visibleColumns.push_back(ccLastName);
     visibleColumns.push_back(ccFirstName);
     visibleColumns.push_back(ccPhone);
+    // Keep display cache consistent with any model change notification
+    connect(this, SIGNAL(modelReset()), this, SLOT(flushDisplayCache()));
+    connect(this, SIGNAL(rowsInserted(QModelIndex,int,int)), this, SLOT(flushDisplayCache()));
+    connect(this, SIGNAL(rowsRemoved(QModelIndex,int,int)), this, SLOT(flushDisplayCache()));
+    connect(this, SIGNAL(dataChanged(QModelIndex,QModelIndex)),
+        this, SLOT(invalidateDisplayRows(QModelIndex,QModelIndex)));
 }
 
 ContactModel::~ContactModel()
@@ -92,67 +132,22 @@ QVariant ContactModel::data(const QModelIndex &index, int role) const
           return QVariant();
       if (index.row() >= items.count())
           return QVariant();
-    const ContactItem& c = items[index.row()];
     if (role==Qt::DisplayRole) {
-        // Detect column
-        ContactColumn col = visibleColumns[index.column()];
-        switch (col) {
-            case ccLastName:    return !c.names.isEmpty() ? c.names[0] : QVariant();
-            case ccFirstName:   return c.names.count()>1  ? c.names[1] : QVariant();
-            case ccMiddleName:  return c.names.count()>2  ? c.names[2] : QVariant();
-            case ccFullName:    return c.fullName;
-            case ccGenericName: return c.visibleName; // must be calculated
-            case ccPhone:       return c.prefPhone;
-            case ccAllPhones:   return c.allPhones;
-            case ccHomePhone:   return c.homePhone;
-            case ccWorkPhone:   return c.workPhone;
-            case ccCellPhone:   return c.cellPhone;
-            case ccEMail:       return c.prefEmail;
-            case ccBDay:        return c.birthday.toString(DateItem::Local);
-            case ccGroups:      return c.groups.join(", ");
-            case ccTitle:       return c.title;
-            case ccOrg:         return c.organization;
-            case ccAddr:  {
-                QString res = "";
-                foreach (const PostalAddress& addr, c.addrs) {
-                    QString sAddr = addr.toString(true);
-                    if (!sAddr.isEmpty()) {
-                        if (!res.isEmpty())
-                            res += "; ";
-                        res += sAddr;
-                    }
-                }
-                return res;
-            }
-            case ccNickName:    return c.nickName;
-            case ccUrl:         return c.url;
-            case ccIM:          return c.prefIM;
-            case ccIMJabber:    return c.findIMByType("xmpp");
-            case ccIMICQ:       return c.findIMByType("icq");
-            case ccIMSkype:     return c.findIMByType("skype");
-            case ccHasPhone:    return !c.phones.isEmpty() ? "*" : QVariant();
-            case ccHasEmail:    return !c.emails.isEmpty() ? "*" : QVariant();
-            case ccHasBDay:     return !c.birthday.isEmpty() ? "*" : QVariant();
-            case ccHasPhoto:    return !c.photo.isEmpty() ? "*" : QVariant();
-            case ccSomePhones:  return c.phones.count()>1  ? "*" : QVariant();
-            case ccSomeEmails:  return c.emails.count()>1  ? "*" : QVariant();
-            case ccLast: { return QVariant(); } // Boundary case
-            default: return QVariant();
+        DisplayCacheRow& r = cachedRow(index.row());
+        int col = index.column();
+        if (!r.cellReady.testBit(col)) {
+            r.cells[col] = displayValue(items[index.row()], visibleColumns[col]);
+            r.cellReady.setBit(col);
         }
+        return r.cells[col];
     }
     else if (role==Qt::BackgroundRole) {
-        switch (_viewMode) {
-        case ContactModel::Standard:
-            return (c.unknownTags.isEmpty()) ? QVariant() : QBrush(Qt::yellow);
-        case ContactModel::CompareOpposite:
-        case ContactModel::CompareMain:
-            return(c.pairState==ContactItem::PairNotFound ? QBrush(Qt::red) :
-                (c.pairState==ContactItem::PairIdentical ? QBrush(Qt::green) :
-                    (c.pairState==ContactItem::PairSimilar ? QBrush(Qt::yellow) : QVariant())));
-        case ContactModel::DupSearch:
-            // TODO
-            break;
+        DisplayCacheRow& r = cachedRow(index.row());
+        if (!r.backgroundReady) {
+            r.background = backgroundValue(items[index.row()]);
+            r.backgroundReady = true;
         }
+        return r.background;
     }
         return QVariant();
 }
@@ -164,72 +159,61 @@ Qt::DropActions ContactModel::supportedDropActions() const
 
 QStringList ContactModel::mimeTypes() const
 {
-    return QStringList() << "text/vcard";
+    return QStringList() << MIME_TYPE_CONTACTS << MIME_TYPE_VCARD;
 }
 
 QMimeData *ContactModel::mimeData(const QModelIndexList &indexes) const
 {
-    VCardData d;
-    d.setSkipCoding(true, true);
-    QStringList lines, errors;
-    QMimeData *mimeData = new QMimeData();
-    QByteArray encodedData;
-    QTextStream stream(&encodedData, QIODevice::WriteOnly);
+    ContactList selected;
     foreach (const QModelIndex &index, indexes)
-    if (index.isValid() && index.column()==0)
-    {
-        const ContactItem& c = items[index.row()];
-        lines.clear();
-        d.exportRecord(lines, c, errors);
-        foreach(const QString& s, lines)
-            stream << s << "\n";
-        stream.flush();
-    }
-    mimeData->setData(mimeTypes()[0], encodedData);
-    return mimeData;
+        if (index.isValid() && index.column()==0)
+            selected << items[index.row()];
+    return new ContactMimeData(selected);
 }
-#include <iostream>
+
 bool ContactModel::dropMimeData(const QMimeData *data, Qt::DropAction action,
-      int, int column, const QModelIndex& index)
+      int row, int column, const QModelIndex& index)
 {
     if (action == Qt::IgnoreAction)
          return true;
-    if (!data->hasFormat("text/vcard"))
-         return false;
     if (column > 0)
          return false;
-    QByteArray encodedData = data->data("text/vcard");
-    QTextStream stream(&encodedData, QIODevice::ReadOnly);
-    QStringList lines, errors;
-    VCardData d;
-    d.setSkipCoding(true, true);
-    beginResetModel();
-    while (!stream.atEnd()) {
-        QString s = stream.readLine();
-        lines << s;
-    }
-    if (index.row()==-1)
-        d.importRecords(lines, items, true, errors);
-    else {
+    // Between rows, onto row or after last row
+    int pos = (row!=-1) ? row : (index.isValid() ? index.row() : items.count());
+    const ContactMimeData* contactData = qobject_cast<const ContactMimeData*>(data);
+    if (contactData) // from this program - no serialization
+        insertItems(pos, contactData->contacts());
+    else if (data->hasFormat(MIME_TYPE_VCARD)) {
+        QByteArray encodedData = data->data(MIME_TYPE_VCARD);
+        QTextStream stream(&encodedData, QIODevice::ReadOnly);
+        QStringList lines, errors;
+        VCardData d;
+        d.setSkipCoding(true, true);
+        while (!stream.atEnd()) {
+            QString s = stream.readLine();
+            lines << s;
+        }
         ContactList addition;
         d.importRecords(lines, addition, false, errors);
-        for(int i=0; i<addition.count(); i++)
-            items.insert(index.row()+i, addition[i]);
+        insertItems(pos, addition);
     }
-    endResetModel();
-    _changed = true;
-    // TODO insert to pointed line
+    else
+        return false;
     return (action == Qt::CopyAction || action == Qt::MoveAction);
 }
 
 bool ContactModel::removeRows(int row, int count, const QModelIndex&)
 {
+    if (count<1 || row<0 || row+count>items.count())
+        return false;
     beginRemoveRows (QModelIndex(), row, row+count-1);
-    for (int i=row+count-1; i>=row; i--)
-        items.removeAt(i);
+    for (int i=row; i<row+count; i++)
+        if (!items[i].fileName.isEmpty())
+            items.removedFiles << items[i].fileName;
+    items.erase(items.begin()+row, items.begin()+row+count);
     endRemoveRows();
     _changed = true;
-    return false;
+    return true;
 }
 
 bool ContactModel::open(const QString& path, FormatType fType, QStringList &errors, QString &fatalError)
@@ -325,8 +309,32 @@ void ContactModel::close()
 
 void ContactModel::addRow(const ContactItem& c)
 {
-    beginInsertRows(QModelIndex(), 0, 0);
+    beginInsertRows(QModelIndex(), items.count(), items.count());
     items.push_back(c);
+    items.last().fileName.clear(); // new in this list
+    items.last().modified = true;
+    endInsertRows();
+    _changed = true;
+}
+
+void ContactModel::addRows(const QList<ContactItem> &newItems)
+{
+    insertItems(items.count(), newItems);
+}
+
+void ContactModel::insertItems(int row, const QList<ContactItem> &newItems)
+{
+    if (newItems.isEmpty())
+        return;
+    if (row<0 || row>items.count())
+        row = items.count();
+    beginInsertRows(QModelIndex(), row, row+newItems.count()-1);
+    items.insertItems(row, newItems);
+    // Inserted items are new in this list, even if have own files elsewhere
+    for (int i=row; i<row+newItems.count(); i++) {
+        items[i].fileName.clear();
+        items[i].modified = true;
+    }
     endInsertRows();
     _changed = true;
 }
@@ -338,25 +346,54 @@ ContactItem& ContactModel::beginEditRow(QModelIndex& index)
 
 void ContactModel::endEditRow(QModelIndex& index)
 {
+    items[index.row()].modified = true;
     _changed = true;
     emit dataChanged(index, index.sibling(index.row(), columnCount()-1));
 }
 
+void ContactModel::photoLoaded(int row)
+{
+    if (row<0 || row>=items.count())
+        return;
+    QModelIndex index = this->index(row, 0);
+    endEditRow(index);
+}
+
 void ContactModel::copyRows(QModelIndexList& indices, ContactModel* target)
 {
+    QList<ContactItem> copies;
     foreach(QModelIndex index, indices)
-        target->addRow(items[index.row()]);
+        copies << items[index.row()];
+    target->addRows(copies);
 }
 
 void ContactModel::removeAnyRows(QModelIndexList& indices)
 {
-    qSort(indices.begin(), indices.end());
-    // foreach not usable here - reverse order needed
-    beginRemoveRows (QModelIndex(), 0, indices.count()-1);
-    for (int i=indices.count()-1; i>=0; i--)
-        items.removeAt(indices[i].row());
-    endRemoveRows();
-    _changed = true;
+    if (indices.isEmpty())
+        return;
+    QList<int> rows;
+    foreach(const QModelIndex& index, indices)
+        rows << index.row();
+    qSort(rows);
+    // Coalesce selection into contiguous ranges (first, last)
+    QList<QPair<int, int> > ranges;
+    foreach(int row, rows) {
+        if (!ranges.isEmpty() && row<=ranges.last().second+1)
+            ranges.last().second = row;
+        else
+            ranges << qMakePair(row, row);
+    }
+    if (ranges.count()>MAX_SEPARATE_REMOVE_RANGES) {
+        // Too scattered selection: per-range signals will cost more
+        // than views rebuild, so compact list in one pass
+        beginResetModel();
+        items.removeItems(rows);
+        endResetModel();
+        _changed = true;
+    }
+    else // reverse order needed to keep lower ranges valid
+        for (int i=ranges.count()-1; i>=0; i--)
+            removeRows(ranges[i].first, ranges[i].second-ranges[i].first+1, QModelIndex());
 }
 
 void ContactModel::swapNames(const QModelIndexList& indices)
@@ -451,6 +488,7 @@ void ContactModel::splitNumbers(const QModelIndexList &indices)
         }
         while (item.phones.count()>1)
             item.phones.removeLast();
+        item.modified = true;
         endInsertRows();
     }
     _changed = true;
@@ -477,29 +515,35 @@ void ContactModel::renameGroup(const QString &oldName, const QString &newName)
 {
     if (items.renameGroup(oldName, newName))
         _changed = true;
+    flushDisplayCache();
 }
 
 void ContactModel::removeGroup(const QString &group)
 {
     if (items.removeGroup(group))
         _changed = true;
+    flushDisplayCache();
 }
 
 void ContactModel::mergeGroups(const QString &unitedGroup, const QString &mergedGroup)
 {
     items.mergeGroups(unitedGroup, mergedGroup);
     _changed = true;
+    flushDisplayCache();
 }
 
 void ContactModel::splitGroup(const QString &existGroup, const QString &newGroup, const QList<int> &movedIndicesInGroup)
 {
     items.splitGroup(existGroup, newGroup, movedIndicesInGroup);
     _changed = true;
+    flushDisplayCache();
 }
 
 void ContactModel::hardSort(ContactList::SortType sortType)
 {
+    beginResetModel();
     items.sort(sortType);
+    endResetModel();
     _changed = true;
 }
 
@@ -587,6 +631,98 @@ void ContactModel::testList()
     endInsertRows();
 }
 
+ContactModel::DisplayCacheRow& ContactModel::cachedRow(int row) const
+{
+    // Row set changed without notification - don't trust any cached row
+    if (displayCache.count()!=items.count()) {
+        displayCache.clear();
+        displayCache.resize(items.count());
+    }
+    DisplayCacheRow& r = displayCache[row];
+    if (r.cells.count()!=visibleColumns.count()) {
+        r.cells.fill(QVariant(), visibleColumns.count());
+        r.cellReady.fill(false, visibleColumns.count());
+    }
+    return r;
+}
+
+QVariant ContactModel::displayValue(const ContactItem &c, ContactColumn col) const
+{
+    switch (col) {
+        case ccLastName:    return !c.names.isEmpty() ? c.names[0] : QVariant();
+        case ccFirstName:   return c.names.count()>1  ? c.names[1] : QVariant();
+        case ccMiddleName:  return c.names.count()>2  ? c.names[2] : QVariant();
+        case ccFullName:    return c.fullName;
+        case ccGenericName: return c.visibleName; // must be calculated
+        case ccPhone:       return c.prefPhone;
+        case ccAllPhones:   return c.allPhones;
+        case ccHomePhone:   return c.homePhone;
+        case ccWorkPhone:   return c.workPhone;
+        case ccCellPhone:   return c.cellPhone;
+        case ccEMail:       return c.prefEmail;
+        case ccBDay:        return c.birthday.toString(DateItem::Local);
+        case ccGroups:      return c.groups.join(", ");
+        case ccTitle:       return c.title;
+        case ccOrg:         return c.organization;
+        case ccAddr:  {
+            QString res = "";
+            foreach (const PostalAddress& addr, c.addrs) {
+                QString sAddr = addr.toString(true);
+                if (!sAddr.isEmpty()) {
+                    if (!res.isEmpty())
+                        res += "; ";
+                    res += sAddr;
+                }
+            }
+            return res;
+        }
+        case ccNickName:    return c.nickName;
+        case ccUrl:         return c.url;
+        case ccIM:          return c.prefIM;
+        case ccIMJabber:    return c.findIMByType("xmpp");
+        case ccIMICQ:       return c.findIMByType("icq");
+        case ccIMSkype:     return c.findIMByType("skype");
+        case ccHasPhone:    return !c.phones.isEmpty() ? "*" : QVariant();
+        case ccHasEmail:    return !c.emails.isEmpty() ? "*" : QVariant();
+        case ccHasBDay:     return !c.birthday.isEmpty() ? "*" : QVariant();
+        case ccHasPhoto:    return !c.photo.isEmpty() ? "*" : QVariant();
+        case ccSomePhones:  return c.phones.count()>1  ? "*" : QVariant();
+        case ccSomeEmails:  return c.emails.count()>1  ? "*" : QVariant();
+        case ccLast: { return QVariant(); } // Boundary case
+        default: return QVariant();
+    }
+}
+
+QVariant ContactModel::backgroundValue(const ContactItem &c) const
+{
+    switch (_viewMode) {
+    case ContactModel::Standard:
+        return (c.unknownTags.isEmpty()) ? QVariant() : QBrush(Qt::yellow);
+    case ContactModel::CompareOpposite:
+    case ContactModel::CompareMain:
+        return(c.pairState==ContactItem::PairNotFound ? QBrush(Qt::red) :
+            (c.pairState==ContactItem::PairIdentical ? QBrush(Qt::green) :
+                (c.pairState==ContactItem::PairSimilar ? QBrush(Qt::yellow) : QVariant())));
+    case ContactModel::DupSearch:
+        // TODO
+        break;
+    }
+    return QVariant();
+}
+
+void ContactModel::flushDisplayCache()
+{
+    displayCache.clear();
+}
+
+void ContactModel::invalidateDisplayRows(const QModelIndex &topLeft, const QModelIndex &bottomRight)
+{
+    if (displayCache.count()!=items.count())
+        return; // will be rebuilt at next data() call
+    for (int i=topLeft.row(); i<=bottomRight.row() && i<displayCache.count(); i++)
+        displayCache[i] = DisplayCacheRow();
+}
+
 bool ContactModel::checkForCSVProfile(IFormat *format, const QString& originalProfile)
 {
     CSVFile* cFormat = dynamic_cast<CSVFile*>(format);
@@ -15,6 +15,8 @@
 #define CONTACTMODEL_H
 
 #include <QAbstractTableModel>
+#include <QBitArray>
+#include <QMimeData>
 #include <QString>
 #include <QVector>
 
@@ -24,6 +26,28 @@
 #include "globals.h"
 #include "recentlist.h"
 
+// Above this, scattered selection removed via model reset, not range by range
+#define MAX_SEPARATE_REMOVE_RANGES 64
+
+// Drag'n'drop MIME types
+#define MIME_TYPE_CONTACTS "application/x-doublecontact-items"
+#define MIME_TYPE_VCARD "text/vcard"
+
+// In-process drag'n'drop payload: carries contacts as is,
+// vCard text is generated only if other application asks it
+class ContactMimeData : public QMimeData
+{
+    Q_OBJECT
+public:
+    ContactMimeData(const ContactList& contacts);
+    const ContactList& contacts() const;
+    QStringList formats() const;
+protected:
+    QVariant retrieveData(const QString& mimeType, QVariant::Type type) const;
+private:
+    ContactList _contacts;
+};
+
 class ContactModel : public QAbstractTableModel
 {
     Q_OBJECT
@@ -51,7 +75,7 @@ public:
     QStringList mimeTypes() const;
     QMimeData* mimeData(const QModelIndexList &indexes) const;
     virtual bool dropMimeData (const QMimeData * data, Qt::DropAction action,
-          int, int column, const QModelIndex& index);
+          int row, int column, const QModelIndex& index);
     bool removeRows(int row, int count, const QModelIndex&);
     // Save and open methods
     bool open(const QString& path, FormatType fType, QStringList &errors, QString &fatalError);
@@ -59,6 +83,7 @@ public:
     void close();
     // Contact operation methods
     void addRow(const ContactItem& c);
+    void addRows(const QList<ContactItem>& newItems); // with one view update
     ContactItem& beginEditRow(QModelIndex& index);
     void endEditRow(QModelIndex& index);
     void copyRows(QModelIndexList& indices, ContactModel* target);
@@ -88,6 +113,10 @@ public:
 signals:
     void requestCSVProfile(CSVFile* format);
 public slots:
+    void photoLoaded(int row); // by ImageLoader
+private slots:
+    void flushDisplayCache();
+    void invalidateDisplayRows(const QModelIndex& topLeft, const QModelIndex& bottomRight);
 protected:
 #if QT_VERSION < 0x040600
     void beginResetModel() {};
@@ -102,6 +131,20 @@ private:
     FormatFactory factory;
     ContactViewMode _viewMode;
     RecentList& _recent;
+    // Display cache: strings and brushes are formatted once per row/visible column,
+    // then data() only returns them; rows dropped on edit, all on column/list change
+    struct DisplayCacheRow {
+        QVector<QVariant> cells;
+        QBitArray cellReady;
+        QVariant background;
+        bool backgroundReady;
+        DisplayCacheRow(): backgroundReady(false) {}
+    };
+    mutable QVector<DisplayCacheRow> displayCache;
+    DisplayCacheRow& cachedRow(int row) const;
+    void insertItems(int row, const QList<ContactItem>& newItems);
+    QVariant displayValue(const ContactItem& c, ContactColumn col) const;
+    QVariant backgroundValue(const ContactItem& c) const;
     bool checkForCSVProfile(IFormat* format, const QString& originalProfile);
 };
 
@@ -0,0 +1,23 @@
+#-------------------------------------------------
+#
+# CardDAV network benchmark against local stand-in server.
+# Doesn't need live server: qmake && make && ./carddavbench
+#
+#-------------------------------------------------
+
+QT       += core network xml
+QT       -= gui
+DEFINES += WITH_NETWORK
+include(../../core/core.pri)
+
+TARGET = carddavbench
+CONFIG   += console
+CONFIG   -= app_bundle
+
+TEMPLATE = app
+
+SOURCES += main.cpp \
+    carddavserver.cpp
+
+HEADERS += \
+    carddavserver.h
@@ -0,0 +1,535 @@
+/* Double Contact
+ *
+ * Module: Local CardDAV stand-in server for network benchmarks
+ *
+ * Copyright 2016 Mikhail Y. Zvyozdochkin aka DarkHobbit <pub@zvyozdochkin.ru>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version. See COPYING file for more details.
+ *
+ */
+#include <QCryptographicHash>
+#include <QHostAddress>
+#include <QStringList>
+#include <QUrl>
+#include <QXmlStreamReader>
+#include <QXmlStreamWriter>
+
+#include "carddavserver.h"
+
+#define CARDDAV_NS "urn:ietf:params:xml:ns:carddav"
+#define STANDIN_BOOK_PATH "/addressbooks/bench/contacts"
+#define STANDIN_TOKEN_PREFIX "http://standin.local/sync/"
+
+StandInConnection::StandInConnection()
+    :closeAfterOut(false)
+{
+}
+
+static QString hrefFor(const QString& name)
+{
+    QString path = QString(STANDIN_BOOK_PATH) + "/" + name;
+    return QString::fromLatin1(QUrl::toPercentEncoding(path, "/"));
+}
+
+static void writeStatus(QXmlStreamWriter& x, const QString& status)
+{
+    x.writeTextElement("DAV:", "status", "HTTP/1.1 " + status);
+}
+
+static void writeCardResponse(QXmlStreamWriter& x, const QString& name, const StandInCard& card, bool withData)
+{
+    x.writeStartElement("DAV:", "response");
+    x.writeTextElement("DAV:", "href", hrefFor(name));
+    x.writeStartElement("DAV:", "propstat");
+    x.writeStartElement("DAV:", "prop");
+    x.writeTextElement("DAV:", "getetag", QString::fromLatin1(card.etag));
+    if (withData)
+        x.writeTextElement(CARDDAV_NS, "address-data", QString::fromUtf8(card.data));
+    else
+        x.writeEmptyElement("DAV:", "resourcetype");
+    x.writeEndElement();
+    writeStatus(x, "200 OK");
+    x.writeEndElement();
+    x.writeEndElement();
+}
+
+static void writeMissingResponse(QXmlStreamWriter& x, const QString& href)
+{
+    x.writeStartElement("DAV:", "response");
+    x.writeTextElement("DAV:", "href", href);
+    writeStatus(x, "404 Not Found");
+    x.writeEndElement();
+}
+
+static void startMultistatus(QXmlStreamWriter& x)
+{
+    x.writeStartDocument();
+    x.writeNamespace("DAV:", "D");
+    x.writeNamespace(CARDDAV_NS, "C");
+    x.writeStartElement("DAV:", "multistatus");
+}
+
+CardDAVStandInServer::CardDAVStandInServer(QObject *parent)
+    :QObject(parent), bytesReceived(0), bytesSent(0), connectionCount(0),
+      lastTick(0), latency(0), bandwidth(0), version(0)
+{
+    connect(&server, SIGNAL(newConnection()), this, SLOT(onNewConnection()));
+    connect(&ticker, SIGNAL(timeout()), this, SLOT(onTick()));
+    ticker.setInterval(STANDIN_TICK);
+}
+
+CardDAVStandInServer::~CardDAVStandInServer()
+{
+    qDeleteAll(connections);
+}
+
+void CardDAVStandInServer::generate(int count)
+{
+    cards.clear();
+    version = 0;
+    for (int i=0; i<count; i++) {
+        QString id = QString("bench-%1").arg(i, 6, 10, QChar('0'));
+        QString vCard = QString(
+            "BEGIN:VCARD\r\n"
+            "VERSION:3.0\r\n"
+            "UID:%1\r\n"
+            "N:Contact%2;Bench;;;\r\n"
+            "FN:Bench Contact%2\r\n"
+            "TEL;TYPE=CELL:+1555%3\r\n"
+            "TEL;TYPE=WORK:+1666%3\r\n"
+            "EMAIL;TYPE=INTERNET:bench%2@example.com\r\n"
+            "ORG:Benchmark Inc.\r\n"
+            "NOTE:Generated contact %2 for network benchmark\r\n"
+            "END:VCARD\r\n")
+            .arg(id).arg(i).arg(i, 7, 10, QChar('0'));
+        storeCard(id + ".vcf", vCard.toUtf8());
+    }
+}
+
+void CardDAVStandInServer::setLatency(int msecs)
+{
+    latency = qMax(msecs, 0);
+}
+
+void CardDAVStandInServer::setBandwidth(int bytesPerSecond)
+{
+    bandwidth = qMax(bytesPerSecond, 0);
+}
+
+bool CardDAVStandInServer::start(quint16 port)
+{
+    clock.start();
+    // Never exposed outside of this machine
+    return server.listen(QHostAddress::LocalHost, port);
+}
+
+quint16 CardDAVStandInServer::port() const
+{
+    return server.serverPort();
+}
+
+QString CardDAVStandInServer::bookPath() const
+{
+    return STANDIN_BOOK_PATH;
+}
+
+int CardDAVStandInServer::cardCount() const
+{
+    int count = 0;
+    foreach (const StandInCard& card, cards)
+        if (!card.deleted)
+            count++;
+    return count;
+}
+
+void CardDAVStandInServer::addResource(const QString &path, const QByteArray &data)
+{
+    resources[path] = data;
+}
+
+QByteArray CardDAVStandInServer::resource(const QString &path) const
+{
+    return resources.value(path);
+}
+
+void CardDAVStandInServer::addRedirect(const QString &path, const QString &target)
+{
+    redirects[path] = target;
+}
+
+void CardDAVStandInServer::resetCounters()
+{
+    requestCounts.clear();
+    pathCounts.clear();
+    bytesReceived = 0;
+    bytesSent = 0;
+    connectionCount = 0;
+}
+
+void CardDAVStandInServer::onNewConnection()
+{
+    while (server.hasPendingConnections()) {
+        QTcpSocket* socket = server.nextPendingConnection();
+        connections[socket] = new StandInConnection;
+        connectionCount++;
+        connect(socket, SIGNAL(readyRead()), this, SLOT(onReadyRead()));
+        connect(socket, SIGNAL(disconnected()), this, SLOT(onDisconnected()));
+    }
+}
+
+void CardDAVStandInServer::onReadyRead()
+{
+    QTcpSocket* socket = qobject_cast<QTcpSocket*>(QObject::sender());
+    StandInConnection* conn = connections.value(socket, 0);
+    if (!conn)
+        return;
+    QByteArray data = socket->readAll();
+    bytesReceived += data.size();
+    conn->in += data;
+    // Pipelined requests are answered in order
+    StandInRequest req;
+    while (!conn->closeAfterOut && parseRequest(conn->in, req)) {
+        bool close = false;
+        QByteArray resp = handle(req, close);
+        enqueue(socket, resp, close);
+        if (close)
+            break;
+        req = StandInRequest();
+    }
+}
+
+void CardDAVStandInServer::onDisconnected()
+{
+    QTcpSocket* socket = qobject_cast<QTcpSocket*>(QObject::sender());
+    if (!socket)
+        return;
+    delete connections.take(socket);
+    socket->deleteLater();
+}
+
+void CardDAVStandInServer::onTick()
+{
+    qint64 now = clock.elapsed();
+    qint64 budget = bandwidth>0 ? bandwidth*(now-lastTick)/1000 : -1;
+    if (budget==0) // Too slow link for one tick; wait for next one
+        return;
+    lastTick = now;
+    bool busy = false;
+    foreach (QTcpSocket* socket, connections.keys()) {
+        StandInConnection* conn = connections[socket];
+        sendOut(socket, conn, budget);
+        if (!conn->pending.isEmpty() || !conn->out.isEmpty())
+            busy = true;
+    }
+    if (!busy)
+        ticker.stop();
+}
+
+bool CardDAVStandInServer::parseRequest(QByteArray &in, StandInRequest &req)
+{
+    int headEnd = in.indexOf("\r\n\r\n");
+    if (headEnd==-1)
+        return false;
+    QList<QByteArray> lines = in.left(headEnd).split('\n');
+    QList<QByteArray> requestLine = lines.takeFirst().trimmed().split(' ');
+    foreach (const QByteArray& line, lines) {
+        int colon = line.indexOf(':');
+        if (colon>0)
+            req.headers[line.left(colon).trimmed().toLower()] = line.mid(colon+1).trimmed();
+    }
+    int length = req.headers.value("content-length").toInt();
+    if (in.size()<headEnd+4+length)
+        return false;
+    req.body = in.mid(headEnd+4, length);
+    in.remove(0, headEnd+4+length);
+    if (requestLine.count()>=2) {
+        req.method = requestLine[0];
+        QByteArray target = requestLine[1];
+        if (target.contains('?'))
+            target = target.left(target.indexOf('?'));
+        req.path = QUrl::fromPercentEncoding(target);
+    }
+    return true;
+}
+
+QByteArray CardDAVStandInServer::handle(const StandInRequest &req, bool &close)
+{
+    close = req.headers.value("connection").toLower()=="close";
+    if (req.method.isEmpty()) {
+        close = true;
+        return response(400);
+    }
+    requestCounts[req.method]++;
+    pathCounts[req.path]++;
+    // Resources outside addressbook
+    if (redirects.contains(req.path))
+        return response(302, QByteArray(), QByteArray(), QByteArray(), redirects[req.path].toUtf8());
+    if (resources.contains(req.path))
+        return (req.method=="GET")
+            ? response(200, resources[req.path], "application/octet-stream") : response(405);
+    QString name;
+    if (!resolvePath(req.path, name))
+        return response(404);
+    if (req.method=="OPTIONS")
+        return response(200);
+    else if (req.method=="PROPFIND")
+        return propfind(req, name);
+    else if (req.method=="REPORT")
+        return report(req);
+    else if (name.isEmpty())
+        return response(405);
+    else if (req.method=="GET")
+        return get(name);
+    else if (req.method=="PUT")
+        return put(req, name);
+    else if (req.method=="DELETE")
+        return remove(req, name);
+    else
+        return response(405);
+}
+
+QByteArray CardDAVStandInServer::propfind(const StandInRequest &req, const QString &name)
+{
+    QByteArray body;
+    QXmlStreamWriter x(&body);
+    startMultistatus(x);
+    if (name.isEmpty()) {
+        // Addressbook itself
+        x.writeStartElement("DAV:", "response");
+        x.writeTextElement("DAV:", "href", QString::fromLatin1(QUrl::toPercentEncoding(bookPath() + "/", "/")));
+        x.writeStartElement("DAV:", "propstat");
+        x.writeStartElement("DAV:", "prop");
+        x.writeStartElement("DAV:", "resourcetype");
+        x.writeEmptyElement("DAV:", "collection");
+        x.writeEmptyElement(CARDDAV_NS, "addressbook");
+        x.writeEndElement();
+        x.writeTextElement("DAV:", "sync-token", syncToken());
+        x.writeEndElement();
+        writeStatus(x, "200 OK");
+        x.writeEndElement();
+        x.writeEndElement();
+        if (req.headers.value("depth")!="0")
+            for (QMap<QString, StandInCard>::const_iterator i=cards.constBegin(); i!=cards.constEnd(); ++i)
+                if (!i.value().deleted)
+                    writeCardResponse(x, i.key(), i.value(), false);
+    }
+    else if (cards.contains(name) && !cards[name].deleted)
+        writeCardResponse(x, name, cards[name], false);
+    else
+        return response(404);
+    x.writeEndElement();
+    x.writeEndDocument();
+    return response(207, body, "application/xml; charset=utf-8");
+}
+
+QByteArray CardDAVStandInServer::report(const StandInRequest &req)
+{
+    QXmlStreamReader xml(req.body);
+    QString kind, text, token;
+    QStringList hrefs;
+    while (!xml.atEnd()) {
+        xml.readNext();
+        if (xml.isStartElement()) {
+            if (kind.isEmpty())
+                kind = xml.name().toString();
+            text.clear();
+        }
+        else if (xml.isCharacters())
+            text += xml.text();
+        else if (xml.isEndElement()) {
+            if (xml.name()==QLatin1String("href"))
+                hrefs << text.trimmed();
+            else if (xml.name()==QLatin1String("sync-token"))
+                token = text.trimmed();
+        }
+    }
+    if (xml.hasError())
+        return response(400);
+    QByteArray body;
+    QXmlStreamWriter x(&body);
+    if (kind=="addressbook-multiget") {
+        startMultistatus(x);
+        foreach (const QString& href, hrefs) {
+            QString name;
+            QString path = QUrl::fromPercentEncoding(href.toUtf8());
+            if (path.startsWith("http"))
+                path = QUrl(path).path();
+            if (resolvePath(path, name) && cards.contains(name) && !cards[name].deleted)
+                writeCardResponse(x, name, cards[name], true);
+            else
+                writeMissingResponse(x, href);
+        }
+    }
+    else if (kind=="sync-collection") {
+        // Empty token means initial synchronization
+        int since = 0;
+        if (!token.isEmpty()) {
+            bool ok = token.startsWith(STANDIN_TOKEN_PREFIX);
+            if (ok)
+                since = token.mid(QString(STANDIN_TOKEN_PREFIX).length()).toInt(&ok);
+            if (!ok || since>version)
+                return response(403,
+                    "<?xml version=\"1.0\"?><D:error xmlns:D=\"DAV:\"><D:valid-sync-token/></D:error>",
+                    "application/xml; charset=utf-8");
+        }
+        startMultistatus(x);
+        for (QMap<QString, StandInCard>::const_iterator i=cards.constBegin(); i!=cards.constEnd(); ++i) {
+            if (i.value().changed<=since)
+                continue;
+            if (i.value().deleted) {
+                if (!token.isEmpty())
+                    writeMissingResponse(x, hrefFor(i.key()));
+            }
+            else
+                writeCardResponse(x, i.key(), i.value(), false);
+        }
+        x.writeTextElement("DAV:", "sync-token", syncToken());
+    }
+    else
+        return response(501);
+    x.writeEndElement();
+    x.writeEndDocument();
+    return response(207, body, "application/xml; charset=utf-8");
+}
+
+QByteArray CardDAVStandInServer::get(const QString &name)
+{
+    if (!cards.contains(name) || cards[name].deleted)
+        return response(404);
+    const StandInCard& card = cards[name];
+    return response(200, card.data, "text/vcard; charset=utf-8", card.etag);
+}
+
+QByteArray CardDAVStandInServer::put(const StandInRequest &req, const QString &name)
+{
+    if (preconditionFailed(req, name))
+        return response(412);
+    bool created = !cards.contains(name) || cards[name].deleted;
+    storeCard(name, req.body);
+    return response(created ? 201 : 204, QByteArray(), QByteArray(), cards[name].etag);
+}
+
+QByteArray CardDAVStandInServer::remove(const StandInRequest &req, const QString &name)
+{
+    if (!cards.contains(name) || cards[name].deleted)
+        return response(404);
+    if (preconditionFailed(req, name))
+        return response(412);
+    StandInCard& card = cards[name];
+    card.changed = ++version;
+    card.deleted = true;
+    card.data.clear();
+    card.etag.clear();
+    return response(204);
+}
+
+bool CardDAVStandInServer::preconditionFailed(const StandInRequest &req, const QString &name)
+{
+    bool exists = cards.contains(name) && !cards[name].deleted;
+    if (req.headers.contains("if-match")) {
+        QByteArray ifMatch = req.headers.value("if-match");
+        if (!exists || (ifMatch!="*" && ifMatch!=cards[name].etag))
+            return true;
+    }
+    return exists && req.headers.value("if-none-match")=="*";
+}
+
+bool CardDAVStandInServer::resolvePath(const QString &path, QString &name) const
+{
+    // Addressbook itself or its direct member
+    if (path==bookPath() || path==bookPath() + "/") {
+        name.clear();
+        return true;
+    }
+    if (!path.startsWith(bookPath() + "/"))
+        return false;
+    name = path.mid(bookPath().length()+1);
+    return !name.isEmpty() && !name.contains('/');
+}
+
+QString CardDAVStandInServer::syncToken() const
+{
+    return QString(STANDIN_TOKEN_PREFIX) + QString::number(version);
+}
+
+void CardDAVStandInServer::storeCard(const QString &name, const QByteArray &data)
+{
+    StandInCard& card = cards[name];
+    card.data = data;
+    card.changed = ++version;
+    card.deleted = false;
+    card.etag = "\"" + QByteArray::number(version) + "-"
+        + QCryptographicHash::hash(data, QCryptographicHash::Sha1).toHex().left(8) + "\"";
+}
+
+QByteArray CardDAVStandInServer::response(int status, const QByteArray &body,
+    const QByteArray &contentType, const QByteArray &etag, const QByteArray &location)
+{
+    QByteArray reason;
+    switch (status) {
+    case 200: reason = "OK"; break;
+    case 201: reason = "Created"; break;
+    case 204: reason = "No Content"; break;
+    case 207: reason = "Multi-Status"; break;
+    case 302: reason = "Found"; break;
+    case 400: reason = "Bad Request"; break;
+    case 403: reason = "Forbidden"; break;
+    case 404: reason = "Not Found"; break;
+    case 405: reason = "Method Not Allowed"; break;
+    case 412: reason = "Precondition Failed"; break;
+    default: reason = "Not Implemented"; break;
+    }
+    QByteArray data = "HTTP/1.1 " + QByteArray::number(status) + " " + reason + "\r\n";
+    data += "Content-Length: " + QByteArray::number(body.size()) + "\r\n";
+    if (!contentType.isEmpty())
+        data += "Content-Type: " + contentType + "\r\n";
+    if (!etag.isEmpty())
+        data += "ETag: " + etag + "\r\n";
+    if (!location.isEmpty())
+        data += "Location: " + location + "\r\n";
+    if (status==200 || status==207)
+        data += "DAV: 1, 3, addressbook\r\n";
+    data += "\r\n";
+    data += body;
+    return data;
+}
+
+void CardDAVStandInServer::enqueue(QTcpSocket *socket, const QByteArray &data, bool close)
+{
+    StandInConnection* conn = connections[socket];
+    StandInResponse resp;
+    resp.due = clock.elapsed() + latency;
+    resp.data = data;
+    resp.close = close;
+    conn->pending << resp;
+    if (latency==0 && bandwidth==0)
+        sendOut(socket, conn, -1);
+    else if (!ticker.isActive()) {
+        lastTick = clock.elapsed();
+        ticker.start();
+    }
+}
+
+void CardDAVStandInServer::sendOut(QTcpSocket *socket, StandInConnection *conn, qint64 budget)
+{
+    // Responses leave in order of requests, each not earlier than its time
+    qint64 now = clock.elapsed();
+    while (!conn->closeAfterOut && !conn->pending.isEmpty() && conn->pending.first().due<=now) {
+        StandInResponse resp = conn->pending.takeFirst();
+        conn->out += resp.data;
+        conn->closeAfterOut = resp.close;
+    }
+    qint64 size = (budget<0) ? conn->out.size() : qMin<qint64>(budget, conn->out.size());
+    if (size>0) {
+        qint64 written = socket->write(conn->out.constData(), size);
+        if (written>0) {
+            conn->out.remove(0, written);
+            bytesSent += written;
+        }
+    }
+    if (conn->out.isEmpty() && conn->closeAfterOut)
+        socket->disconnectFromHost();
+}
@@ -0,0 +1,126 @@
+/* Double Contact
+ *
+ * Module: Local CardDAV stand-in server for network benchmarks
+ *
+ * Copyright 2016 Mikhail Y. Zvyozdochkin aka DarkHobbit <pub@zvyozdochkin.ru>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version. See COPYING file for more details.
+ *
+ */
+#ifndef CARDDAVSERVER_H
+#define CARDDAVSERVER_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QHash>
+#include <QList>
+#include <QMap>
+#include <QTcpServer>
+#include <QTcpSocket>
+#include <QTimer>
+
+// Sending tick for latency and bandwidth emulation
+#define STANDIN_TICK 5
+
+// One vCard resource of addressbook
+struct StandInCard
+{
+    QByteArray data;
+    QByteArray etag; // quoted
+    int changed; // collection version of last change
+    bool deleted;
+};
+
+// One parsed HTTP request
+struct StandInRequest
+{
+    QByteArray method;
+    QString path;
+    QHash<QByteArray, QByteArray> headers; // names in lower case
+    QByteArray body;
+};
+
+// Response waiting for its time to be sent
+struct StandInResponse
+{
+    qint64 due; // msecs since server start
+    QByteArray data;
+    bool close;
+};
+
+// Client connection with its incoming data and response queue
+struct StandInConnection
+{
+    QByteArray in;
+    QList<StandInResponse> pending;
+    QByteArray out;
+    bool closeAfterOut;
+    StandInConnection();
+};
+
+// Minimal loopback-only HTTP/1.1 server with one CardDAV addressbook.
+// Supports PROPFIND, GET, REPORT (addressbook-multiget, sync-collection),
+// PUT and DELETE with If-Match/If-None-Match. Besides addressbook, it
+// serves static resources and redirects (i.e. contact photos by URL).
+// Responses can be delayed by fixed latency and sent with limited
+// bandwidth per connection
+class CardDAVStandInServer : public QObject
+{
+    Q_OBJECT
+public:
+    explicit CardDAVStandInServer(QObject *parent = 0);
+    ~CardDAVStandInServer();
+    void generate(int count);
+    void setLatency(int msecs);
+    void setBandwidth(int bytesPerSecond); // 0 - unlimited
+    bool start(quint16 port = 0);
+    quint16 port() const;
+    QString bookPath() const;
+    int cardCount() const;
+    void addResource(const QString& path, const QByteArray& data);
+    QByteArray resource(const QString& path) const;
+    void addRedirect(const QString& path, const QString& target);
+    // Statistics
+    QMap<QByteArray, int> requestCounts;
+    QMap<QString, int> pathCounts;
+    qint64 bytesReceived, bytesSent;
+    int connectionCount;
+    void resetCounters();
+private slots:
+    void onNewConnection();
+    void onReadyRead();
+    void onDisconnected();
+    void onTick();
+private:
+    QTcpServer server;
+    QTimer ticker;
+    QElapsedTimer clock;
+    qint64 lastTick;
+    int latency, bandwidth;
+    int version; // of collection, for sync-token
+    QMap<QString, StandInCard> cards; // by name, sorted
+    QHash<QTcpSocket*, StandInConnection*> connections;
+    QHash<QString, QByteArray> resources;
+    QHash<QString, QString> redirects;
+    bool parseRequest(QByteArray& in, StandInRequest& req);
+    QByteArray handle(const StandInRequest& req, bool& close);
+    QByteArray propfind(const StandInRequest& req, const QString& name);
+    QByteArray report(const StandInRequest& req);
+    QByteArray get(const QString& name);
+    QByteArray put(const StandInRequest& req, const QString& name);
+    QByteArray remove(const StandInRequest& req, const QString& name);
+    bool preconditionFailed(const StandInRequest& req, const QString& name);
+    bool resolvePath(const QString& path, QString& name) const;
+    QString syncToken() const;
+    void storeCard(const QString& name, const QByteArray& data);
+    static QByteArray response(int status, const QByteArray& body = QByteArray(),
+        const QByteArray& contentType = QByteArray(), const QByteArray& etag = QByteArray(),
+        const QByteArray& location = QByteArray());
+    void enqueue(QTcpSocket* socket, const QByteArray& data, bool close);
+    void sendOut(QTcpSocket* socket, StandInConnection* conn, qint64 budget);
+};
+
+#endif // CARDDAVSERVER_H